@@ -0,0 +1,387 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "board_state.cpp"
+#include "fen_batch.cpp"
+#include "move_generator.cpp"
+#include "packed_position_store.cpp"
+#include "position_features.cpp"
+#include "position_loader.cpp"
+#include "puzzle_themes.cpp"
+#include "similarity_search.cpp"
+#include "work_stealing_pool.cpp"
+
+#ifdef MEMORY_CHESS_WITH_SFML
+#include "board_renderer.cpp"
+#endif
+
+using namespace std;
+
+// microbenchmarks for the hot paths: loading, FEN parsing, scoring and (when built with SFML) drawing a frame
+// everything runs on a generated csv from a fixed seed, so two builds see exactly the same input and their numbers
+// can be compared. results come out as JSON
+//
+//   benchmark                      100k row fixture, JSON on stdout
+//   benchmark --rows 1000000 --out results.json
+
+const uint64_t FIXTURE_SEED = 20240601;
+
+// the piece placement field of a random position: both kings plus up to 30 other pieces, pawns kept off the back ranks
+string random_placement(mt19937_64& random_engine) {
+    char squares[64];
+    fill(begin(squares), end(squares), ' ');
+    uniform_int_distribution<int> any_square(0, 63);
+    uniform_int_distribution<int> extra_pieces(0, 30);
+    uniform_int_distribution<int> any_piece(0, PIECE_TYPES - 1);
+
+    auto place = [&](char piece) {
+        while (true) {
+            int square = any_square(random_engine);
+            bool back_rank = square < 8 || square >= 56;
+            if (squares[square] == ' ' && !((piece == 'P' || piece == 'p') && back_rank)) {
+                squares[square] = piece;
+                return;
+            }
+        }
+    };
+    place('K');
+    place('k');
+    int extras = extra_pieces(random_engine);
+    for (int i = 0; i < extras; i++) {
+        char piece = PIECE_CHARS[any_piece(random_engine)];
+        place(piece == 'K' ? 'Q' : piece == 'k' ? 'q' : piece);
+    }
+
+    string fen;
+    for (int rank = 0; rank < 8; rank++) {
+        int empty = 0;
+        for (int file = 0; file < 8; file++) {
+            char piece = squares[rank * 8 + file];
+            if (piece == ' ') {
+                empty++;
+                continue;
+            }
+            if (empty > 0) {
+                fen += char('0' + empty);
+                empty = 0;
+            }
+            fen += piece;
+        }
+        if (empty > 0) {
+            fen += char('0' + empty);
+        }
+        if (rank < 7) {
+            fen += '/';
+        }
+    }
+    return fen;
+}
+
+// a random but plausible position: a random_placement redrawn until it passes the loader's is_legal_placement, so
+// no row of the fixture gets thrown out
+string random_fen(mt19937_64& random_engine) {
+    while (true) {
+        string fen = random_placement(random_engine);
+        unsigned long long boards[PIECE_TYPES];
+        if (parse_fen_placement(fen, boards) && is_legal_placement(boards, SIDE_WHITE)) {
+            return fen + " w - - 0 1";
+        }
+    }
+}
+
+// writes rows lichess-style puzzle rows to filename, the same ones every time
+bool write_fixture(const string& filename, uint32_t rows) {
+    ofstream out(filename, ios::binary);
+    if (!out) {
+        cerr << "Error, we could not create the file: " << filename << endl;
+        return false;
+    }
+    mt19937_64 random_engine(FIXTURE_SEED);
+    uniform_int_distribution<int> rating(600, 2800);
+    uniform_int_distribution<int> popularity(-100, 100);
+    uniform_int_distribution<int> plays(0, 50000);
+    uniform_int_distribution<int> theme(0, PUZZLE_THEME_COUNT - 1);
+
+    out << "PuzzleId,FEN,Moves,Rating,RatingDeviation,Popularity,NbPlays,Themes,GameUrl,OpeningTags\n";
+    for (uint32_t i = 0; i < rows; i++) {
+        out << "b" << i << ',' << random_fen(random_engine) << ",e2e4 e7e5," << rating(random_engine) << ",75,"
+            << popularity(random_engine) << ',' << plays(random_engine) << ',' << PUZZLE_THEMES[theme(random_engine)]
+            << ' ' << PUZZLE_THEMES[theme(random_engine)] << ",https://lichess.org/training,\n";
+    }
+    return bool(out);
+}
+
+struct benchmark_result {
+    string name;
+    double value;
+    string unit;
+};
+
+// best time out of repeats runs of body, in seconds -- the fastest run is the one least disturbed by everything
+// else the machine was doing, which makes it the most repeatable number to compare between versions
+double best_of(int repeats, const function<void()>& body) {
+    double best = 1e30;
+    for (int i = 0; i < repeats; i++) {
+        auto start = chrono::steady_clock::now();
+        body();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// keeps the compiler from throwing away work whose result nobody reads
+volatile uint64_t benchmark_sink = 0;
+
+string to_json(const vector<benchmark_result>& results, uint32_t rows) {
+    ostringstream json;
+    json << "{\n  \"fixture\": {\"rows\": " << rows << ", \"seed\": " << FIXTURE_SEED << "},\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        json << "    {\"name\": \"" << results[i].name << "\", \"value\": " << results[i].value
+             << ", \"unit\": \"" << results[i].unit << "\"}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t rows = 100000;
+    string out_filename;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--rows" && i + 1 < argc) {
+            rows = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--out" && i + 1 < argc) {
+            out_filename = argv[++i];
+        }
+        else {
+            cerr << "usage: benchmark [--rows N] [--out results.json]" << endl;
+            return 1;
+        }
+    }
+
+    string fixture = (filesystem::temp_directory_path() / ("memory_chess_benchmark_" + to_string(rows) + ".csv")).string();
+    if (!write_fixture(fixture, rows)) {
+        return 1;
+    }
+
+    vector<benchmark_result> results;
+    const int REPEATS = 5;
+
+    // loading: the old vector loader (first 100 rows only), the mapped loader finding the rows of the whole file, and
+    // that plus the index build it runs in the background (checking, dedupe, features and columns of every row)
+    double seconds = best_of(REPEATS, [&]() {
+        position_loader loader;
+        benchmark_sink = benchmark_sink + loader.load_position(fixture).size();
+    });
+    results.push_back({"load_position", min<double>(rows, 100) / seconds, "rows/s"});
+
+    seconds = best_of(REPEATS, [&]() {
+        position_loader loader;
+        loader.load_position_mapped(fixture, false);
+        benchmark_sink = benchmark_sink + loader.get_mapped_count();
+    });
+    results.push_back({"load_position_mapped", rows / seconds, "rows/s"});
+
+    seconds = best_of(REPEATS, [&]() {
+        position_loader loader;
+        loader.load_position_mapped(fixture);
+        loader.wait_for_load();
+        benchmark_sink = benchmark_sink + loader.get_available_count();
+    });
+    results.push_back({"load_position_mapped+index", rows / seconds, "rows/s"});
+
+    // everything below works on the fixture's FENs and the boards parsed from them
+    position_loader loader;
+    if (!loader.load_position_mapped(fixture, false)) {
+        return 1;
+    }
+    vector<string_view> fens;
+    for (uint32_t i = 0; i < loader.get_mapped_count(); i++) {
+        fens.push_back(csv_field(loader.get_mapped_row(i), COLUMN_FEN));
+    }
+
+    board_state board;
+    seconds = best_of(REPEATS, [&]() {
+        for (string_view fen : fens) {
+            benchmark_sink = benchmark_sink + board.populate_from_FEN(fen);
+        }
+    });
+    results.push_back({"populate_from_FEN", seconds * 1e9 / fens.size(), "ns/position"});
+
+    bitboard_batch batch;
+    seconds = best_of(REPEATS, [&]() {
+        benchmark_sink = benchmark_sink + parse_many(fens.data(), fens.size(), batch);
+    });
+    results.push_back({"parse_many", seconds * 1e9 / fens.size(), "ns/position"});
+
+    // difficulty features, as feature_extractor works them out for every row
+    seconds = best_of(REPEATS, [&]() {
+        unsigned long long position[PIECE_TYPES];
+        for (size_t i = 0; i < batch.size(); i++) {
+            for (int type = 0; type < PIECE_TYPES; type++) {
+                position[type] = batch.boards[type][i];
+            }
+            benchmark_sink = benchmark_sink + compute_features(position).difficulty;
+        }
+    });
+    results.push_back({"compute_features", seconds * 1e9 / batch.size(), "ns/position"});
+
+    // the 10 positions closest to one of them, over the whole fixture on every core
+    work_stealing_pool pool;
+    const int QUERIES = 20;
+    seconds = best_of(REPEATS, [&]() {
+        for (int query = 0; query < QUERIES; query++) {
+            board_state target = batch.get((size_t)query * 7919 % batch.size());
+            benchmark_sink = benchmark_sink + find_similar(batch, target, 10, &pool).size();
+        }
+    });
+    results.push_back({"find_similar", seconds * 1e3 / QUERIES, "ms/query"});
+
+    // the load time legality check of every row, and move generation (perft from the starting position)
+    seconds = best_of(REPEATS, [&]() {
+        unsigned long long position[PIECE_TYPES];
+        for (size_t i = 0; i < batch.size(); i++) {
+            for (int type = 0; type < PIECE_TYPES; type++) {
+                position[type] = batch.boards[type][i];
+            }
+            benchmark_sink = benchmark_sink + is_legal_placement(position, SIDE_WHITE);
+        }
+    });
+    results.push_back({"is_legal_placement", seconds * 1e9 / batch.size(), "ns/position"});
+    chess_position start_position;
+    start_position.populate_from_FEN("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    uint64_t perft_nodes = 0;
+    seconds = best_of(REPEATS, [&]() {
+        perft_nodes = perft(start_position, 4);
+    });
+    results.push_back({"perft", perft_nodes / seconds / 1e6, "Mnodes/s"});
+
+    // packed store: memory per position, and getting a board_state back out of it
+    packed_position_store packed;
+    packed.reserve(fens.size());
+    for (string_view fen : fens) {
+        if (board.populate_from_FEN(fen)) {
+            packed.add(board);
+        }
+    }
+    packed.shrink_to_fit();
+    results.push_back({"packed_store_size", (double)packed.memory_bytes() / packed.size(), "bytes/position"});
+    seconds = best_of(REPEATS, [&]() {
+        for (size_t i = 0; i < packed.size(); i++) {
+            packed.get(i, board);
+            benchmark_sink = benchmark_sink + board.occupancy();
+        }
+    });
+    results.push_back({"packed_store_get", seconds * 1e9 / packed.size(), "ns/position"});
+
+    // scoring pairs: the solution, and a recreation that is right except for every other board missing a piece
+    const size_t PAIRS = min<size_t>(fens.size(), 4096);
+    vector<board_state> solutions(PAIRS);
+    vector<board_state> attempts(PAIRS);
+    for (size_t i = 0; i < PAIRS; i++) {
+        solutions[i].populate_from_FEN(fens[i]);
+        attempts[i] = solutions[i];
+        unsigned long long occupied = attempts[i].occupancy();
+        if (i % 2 == 1 && occupied != 0) {
+            attempts[i].set_piece_at_square(lowest_bit_index(occupied), ' ');
+        }
+    }
+    const int PASSES = 256;
+
+    seconds = best_of(REPEATS, [&]() {
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (size_t i = 0; i < PAIRS; i++) {
+                benchmark_sink = benchmark_sink + attempts[i].how_many_squares_correct(solutions[i]);
+            }
+        }
+    });
+    results.push_back({"how_many_squares_correct", seconds * 1e9 / (PAIRS * PASSES), "ns/compare"});
+
+    seconds = best_of(REPEATS, [&]() {
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (size_t i = 0; i < PAIRS; i++) {
+                benchmark_sink = benchmark_sink + (attempts[i] == solutions[i]);
+            }
+        }
+    });
+    results.push_back({"operator==", seconds * 1e9 / (PAIRS * PASSES), "ns/compare"});
+
+    vector<uint32_t> correct(PAIRS);
+    seconds = best_of(REPEATS, [&]() {
+        for (int pass = 0; pass < PASSES; pass++) {
+            grade_many(attempts.data(), solutions.data(), correct.data(), PAIRS);
+            benchmark_sink = benchmark_sink + correct[pass % PAIRS];
+        }
+    });
+    results.push_back({"grade_many", seconds * 1e9 / (PAIRS * PASSES), "ns/compare"});
+
+    seconds = best_of(REPEATS, [&]() {
+        for (size_t i = 0; i < PAIRS; i++) {
+            for (uint32_t square = 0; square < 64; square++) {
+                benchmark_sink = benchmark_sink + solutions[i].get_piece_at(square);
+            }
+        }
+    });
+    results.push_back({"get_piece_at", seconds * 1e9 / (PAIRS * 64), "ns/call"});
+
+#ifdef MEMORY_CHESS_WITH_SFML
+    // one full frame of the playing screen drawn offscreen: board, palette and a board of pieces, then the same with
+    // a 4x4 grid of boards (which should cost about the same draw calls, only more vertices)
+    // the final copyToImage waits for the GPU, so the time covers the actual drawing and not just queueing it up
+    sf::Font font;
+    sf::RenderTexture target;
+    if (font.openFromFile("fonts/comicbd.ttf") && loadPieceTextures() &&
+        target.resize(sf::Vector2u(WINDOW_WIDTH, WINDOW_HEIGHT))) {
+        sf::Text paletteInstructions(font, "Drag pieces\nonto board\n\nSpace: Check\nC: Clear\nN: New", 14);
+        const int FRAMES = 200;
+        for (int boards : {1, 16}) {
+            setBoardCount(boards);
+            seconds = best_of(REPEATS, [&]() {
+                for (int frame = 0; frame < FRAMES; frame++) {
+                    target.clear(sf::Color(40, 40, 40));
+                    draw_board(target);
+                    drawPalette(target, paletteInstructions);
+                    pieceBatch.clear();
+                    appendPalettePieces(pieceBatch);
+                    for (int board = 0; board < boards; board++) {
+                        appendBoardPieces(pieceBatch, solutions[(frame * boards + board) % PAIRS], board);
+                    }
+                    drawPieceBatch(target, pieceBatch);
+                    target.display();
+                }
+                benchmark_sink = benchmark_sink + target.getTexture().copyToImage().getSize().x;
+            });
+            results.push_back({boards == 1 ? "render_frame" : "render_grid16", seconds * 1e6 / FRAMES, "us/frame"});
+        }
+        setBoardCount(1);
+    }
+    else {
+        cerr << "Warning: fonts/ or assets/ missing, or no offscreen target -- skipping render_frame" << endl;
+    }
+#endif
+
+    filesystem::remove(fixture);
+
+    string json = to_json(results, rows);
+    if (out_filename.empty()) {
+        cout << json;
+    }
+    else {
+        ofstream out(out_filename);
+        out << json;
+        if (!out) {
+            cerr << "Error, failed writing: " << out_filename << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// the few bit tricks we need on 64 bit masks, with the compiler builtin where there is one
+
+// number of set bits
+inline int popcount64(uint64_t bits) {
+#ifdef _MSC_VER
+    return (int)__popcnt64(bits);
+#else
+    return __builtin_popcountll(bits);
+#endif
+}
+
+// index of the lowest set bit. bits must not be zero
+inline int lowest_bit_index(uint64_t bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+// the same board upside down: ranks are whole bytes (square 0 = a8), so that's a byte swap
+inline uint64_t flip_ranks(uint64_t bits) {
+#ifdef _MSC_VER
+    return _byteswap_uint64(bits);
+#else
+    return __builtin_bswap64(bits);
+#endif
+}
+
+// the same board mirrored left to right, a file becomes h file: reverses the bits within every byte
+inline uint64_t mirror_files(uint64_t bits) {
+    bits = ((bits >> 1) & 0x5555555555555555ULL) | ((bits & 0x5555555555555555ULL) << 1);
+    bits = ((bits >> 2) & 0x3333333333333333ULL) | ((bits & 0x3333333333333333ULL) << 2);
+    return ((bits >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((bits & 0x0F0F0F0F0F0F0F0FULL) << 4);
+}
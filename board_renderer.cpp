@@ -0,0 +1,554 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <SFML/Graphics.hpp>
+#include <string>
+#include <vector>
+#include "board_state.cpp"
+#include "frame_profiler.cpp"
+
+using namespace std;
+
+// everything about putting the game on screen with SFML: the layout, the board and palette geometry, the piece atlas
+// and text labels. the game rules themselves live in memory_chess_core.cpp and never see any of this
+
+// we want to display the board and then a palette on the right with all the pieces, that we can drag onto the board 
+
+const int BOARD_SIZE = 800; 
+
+const int SQUARE_SIZE = BOARD_SIZE / 8; 
+
+const int PALETTE_WIDTH = 200;
+
+const int WINDOW_WIDTH = BOARD_SIZE + PALETTE_WIDTH;
+
+const int WINDOW_HEIGHT = BOARD_SIZE; 
+
+// where the boards go in the BOARD_SIZE square: one board filling it, or a grid of 4, 9 or 16 smaller ones (2x2, 3x3,
+// 4x4) for memorizing several positions at once. sizes are whole pixels so squares line up with the screen
+struct BoardGrid {
+    int count = 1;
+    int columns = 1;
+    // space between two boards, and around the grid so it sits in the middle of the board area
+    int gap = 0;
+    int margin = 0;
+    int boardSize = BOARD_SIZE;
+    int squareSize = SQUARE_SIZE;
+
+    // top left corner of a board
+    sf::Vector2f boardOrigin(int board) const {
+        int step = boardSize + gap;
+        return sf::Vector2f(margin + (board % columns) * step, margin + (board / columns) * step);
+    }
+};
+
+BoardGrid boardGrid;
+
+// how the WINDOW_WIDTH x WINDOW_HEIGHT layout above sits in the actual window. everything is laid out and drawn in
+// those layout units, and a view scales them to the window -- by the same amount both ways, with bars at the sides or
+// top and bottom when the window's shape doesn't match. worked out once per resize by setWindowSize, and the mouse is
+// mapped back through the same numbers
+struct ScreenLayout {
+    sf::Vector2u windowSize = sf::Vector2u(WINDOW_WIDTH, WINDOW_HEIGHT);
+    // window pixels per layout unit, and where the layout's top left corner is in the window
+    float scale = 1;
+    sf::Vector2f offset;
+    sf::View view = sf::View(sf::FloatRect(sf::Vector2f(0, 0), sf::Vector2f(WINDOW_WIDTH, WINDOW_HEIGHT)));
+
+    // a window pixel (a mouse position) in layout units
+    sf::Vector2f toLayout(sf::Vector2i pixel) const {
+        return sf::Vector2f((pixel.x - offset.x) / scale, (pixel.y - offset.y) / scale);
+    }
+};
+
+ScreenLayout screenLayout;
+
+// all 12 piece images packed side by side into one texture (stored in memory on GPU), so every piece on screen can
+// be drawn with a single texture bind instead of one texture and one sprite per piece
+sf::Texture pieceAtlas;
+
+// where each piece sits inside the atlas, indexed by piece_type
+sf::FloatRect pieceAtlasRects[PIECE_TYPES];
+
+// the piece images as loaded from assets/, kept to rebuild the atlas at a new size when the window is resized
+sf::Image pieceImages[PIECE_TYPES];
+
+// width of a piece in the atlas right now, 0 until it's first built
+unsigned pieceAtlasSize = 0;
+
+// gap between images in the atlas, so filtering never samples a neighbouring piece. images also start on multiples
+// of it, so the first few mipmap levels keep the pieces apart too
+const unsigned ATLAS_PADDING = 8;
+
+// shrinks an image to size by averaging all the source pixels each new pixel covers (a box filter with fractional
+// edges), weighted by alpha so the transparent background doesn't darken the outlines. the GPU shrinking a big image
+// only reads a few texels per pixel, which is what makes downscaled pieces look grainy
+sf::Image downscaleImage(const sf::Image& source, sf::Vector2u size) {
+    sf::Vector2u sourceSize = source.getSize();
+    const uint8_t* pixels = source.getPixelsPtr();
+    vector<uint8_t> scaled((size_t)size.x * size.y * 4);
+    double stepX = (double)sourceSize.x / size.x;
+    double stepY = (double)sourceSize.y / size.y;
+    for (unsigned y = 0; y < size.y; y++) {
+        double top = y * stepY, bottom = top + stepY;
+        unsigned lastY = min(sourceSize.y, (unsigned)ceil(bottom));
+        for (unsigned x = 0; x < size.x; x++) {
+            double left = x * stepX, right = left + stepX;
+            unsigned lastX = min(sourceSize.x, (unsigned)ceil(right));
+            double red = 0, green = 0, blue = 0, alpha = 0, area = 0;
+            for (unsigned sourceY = (unsigned)top; sourceY < lastY; sourceY++) {
+                double coverY = min(bottom, sourceY + 1.0) - max(top, (double)sourceY);
+                for (unsigned sourceX = (unsigned)left; sourceX < lastX; sourceX++) {
+                    double weight = coverY * (min(right, sourceX + 1.0) - max(left, (double)sourceX));
+                    const uint8_t* pixel = pixels + 4 * ((size_t)sourceY * sourceSize.x + sourceX);
+                    double opacity = weight * pixel[3];
+                    red += opacity * pixel[0];
+                    green += opacity * pixel[1];
+                    blue += opacity * pixel[2];
+                    alpha += opacity;
+                    area += weight;
+                }
+            }
+            uint8_t* out = &scaled[4 * ((size_t)y * size.x + x)];
+            if (alpha > 0) {
+                out[0] = (uint8_t)lround(red / alpha);
+                out[1] = (uint8_t)lround(green / alpha);
+                out[2] = (uint8_t)lround(blue / alpha);
+            }
+            out[3] = (uint8_t)lround(alpha / area);
+        }
+    }
+    return sf::Image(size, scaled.data());
+}
+
+// packs the pieces into the atlas at pieceSize pixels wide (never wider than the images themselves), the size of a
+// board square on screen, so the board's pieces are drawn at close to 1:1. smoothed and mipmapped for everything
+// drawn smaller than that -- the palette, the boards of a grid
+bool buildPieceAtlas(unsigned pieceSize) {
+    sf::Image scaled[PIECE_TYPES];
+    sf::Vector2u atlasSize(0, 0);
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        sf::Vector2u size = pieceImages[type].getSize();
+        if (pieceSize < size.x) {
+            size = sf::Vector2u(pieceSize, max(1u, (unsigned)lround((double)size.y * pieceSize / size.x)));
+            scaled[type] = downscaleImage(pieceImages[type], size);
+        } else {
+            scaled[type] = pieceImages[type];
+        }
+        atlasSize.x += (size.x + 2 * ATLAS_PADDING - 1) / ATLAS_PADDING * ATLAS_PADDING;
+        atlasSize.y = max(atlasSize.y, size.y);
+    }
+    
+    sf::Image atlasImage(atlasSize, sf::Color::Transparent);
+    unsigned x = 0;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        sf::Vector2u size = scaled[type].getSize();
+        if (!atlasImage.copy(scaled[type], sf::Vector2u(x, 0))) {
+            cerr << "Failed to pack piece images into the atlas" << endl;
+            return false;
+        }
+        pieceAtlasRects[type] = sf::FloatRect(sf::Vector2f(x, 0), sf::Vector2f(size.x, size.y));
+        x += (size.x + 2 * ATLAS_PADDING - 1) / ATLAS_PADDING * ATLAS_PADDING;
+    }
+    
+    if (!pieceAtlas.loadFromImage(atlasImage)) {
+        cerr << "Failed to create piece atlas texture" << endl;
+        return false;
+    }
+    pieceAtlas.setSmooth(true);
+    // without mipmaps (no framebuffer object support) the smaller pieces are only smoothed, which still works
+    if (!pieceAtlas.generateMipmap()) {
+        cerr << "Warning: no mipmaps for the piece atlas" << endl;
+    }
+    pieceAtlasSize = pieceSize;
+    
+    return true;
+}
+
+// function to load all piece images and pack them into the atlas
+bool loadPieceTextures() {
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        // assets/wK.png, assets/bp.png ... white pieces are upper case in PIECE_CHARS, black lower case
+        string filename = string("assets/") + (type < BLACK_PAWN ? 'w' : 'b') +
+                          (char)toupper(PIECE_CHARS[type]) + ".png";
+        if (!pieceImages[type].loadFromFile(filename)) {
+            cerr << "Failed to load " << filename << endl;
+            return false;
+        }
+    }
+    
+    return buildPieceAtlas((unsigned)lround(SQUARE_SIZE * screenLayout.scale));
+}
+
+// lays everything out for a window of size pixels. the scale is picked so a board square is a whole number of pixels
+// and the layout is centered on whole pixels, which keeps the square edges sharp, and the piece atlas is rebuilt at
+// that square size (once loaded) so nothing is shrunk on the GPU every frame. the caller sets screenLayout.view on
+// the window
+void setWindowSize(sf::Vector2u size) {
+    // minimized
+    if (size.x == 0 || size.y == 0) return;
+    
+    ScreenLayout layout;
+    layout.windowSize = size;
+    float fit = min((float)size.x / WINDOW_WIDTH, (float)size.y / WINDOW_HEIGHT);
+    layout.scale = max(1.0f, floor(fit * SQUARE_SIZE)) / SQUARE_SIZE;
+    sf::Vector2f layoutSize(WINDOW_WIDTH * layout.scale, WINDOW_HEIGHT * layout.scale);
+    layout.offset = sf::Vector2f(floor((size.x - layoutSize.x) / 2), floor((size.y - layoutSize.y) / 2));
+    layout.view.setViewport(sf::FloatRect(sf::Vector2f(layout.offset.x / size.x, layout.offset.y / size.y),
+                                          sf::Vector2f(layoutSize.x / size.x, layoutSize.y / size.y)));
+    screenLayout = layout;
+    
+    unsigned pieceSize = (unsigned)lround(SQUARE_SIZE * layout.scale);
+    if (pieceAtlasSize != 0 && pieceSize != pieceAtlasSize) {
+        buildPieceAtlas(pieceSize);
+    }
+}
+
+// the window to open with: the layout at the biggest whole multiple that fits on the desktop with some room to spare,
+// so a 4K screen starts at twice the size instead of with a small window
+sf::Vector2u initialWindowSize() {
+    sf::Vector2u desktop = sf::VideoMode::getDesktopMode().size;
+    unsigned multiple = max(1u, min(desktop.x * 9 / 10 / WINDOW_WIDTH, desktop.y * 9 / 10 / WINDOW_HEIGHT));
+    return sf::Vector2u(WINDOW_WIDTH * multiple, WINDOW_HEIGHT * multiple);
+}
+
+// text is drawn in layout units too, so it's rasterized at characterSize times the window scale and then scaled
+// back down -- the glyphs come out at the window's real resolution rather than blown up from small ones
+void setTextPixelScale(sf::Text& text, unsigned characterSize, float scale, float outlineThickness = 0) {
+    text.setCharacterSize(max(1u, (unsigned)lround(characterSize * scale)));
+    if (outlineThickness > 0) {
+        text.setOutlineThickness(outlineThickness * scale);
+    }
+    text.setScale(sf::Vector2f(1 / scale, 1 / scale));
+}
+
+
+// a line of text that is set up once and laid out again only when its string changes
+// sf::Text keeps its glyph vertices between draws, so reusing one object and skipping setString (and the
+// getLocalBounds call that centers it) for an unchanged string makes drawing it cost no layout work at all
+struct TextLabel {
+    sf::Text text;
+    // the point the text is centered on
+    sf::Vector2f center;
+    string current;
+    // sizes in layout units, before the window scale
+    unsigned characterSize;
+    float outlineThickness;
+
+    TextLabel(const sf::Font& font, unsigned characterSize, sf::Color fill, sf::Vector2f center,
+              float outlineThickness = 0)
+        : text(font), center(center), characterSize(characterSize), outlineThickness(outlineThickness) {
+        text.setCharacterSize(characterSize);
+        text.setFillColor(fill);
+        if (outlineThickness > 0) {
+            text.setOutlineColor(sf::Color::Black);
+            text.setOutlineThickness(outlineThickness);
+        }
+    }
+
+    void setString(const string& str) {
+        if (str == current) return;
+        current = str;
+        text.setString(str);
+        layOut();
+    }
+
+    // after a resize, so the text is rasterized at the window's resolution
+    void setPixelScale(float scale) {
+        setTextPixelScale(text, characterSize, scale, outlineThickness);
+        layOut();
+    }
+
+    void layOut() {
+        PROFILE_SCOPE("text_layout");
+        sf::FloatRect bounds = text.getLocalBounds();
+        text.setOrigin(sf::Vector2f(bounds.position.x + bounds.size.x / 2.0f,
+                       bounds.position.y + bounds.size.y / 2.0f));
+        text.setPosition(center);
+    }
+
+    void draw(sf::RenderTarget& target) const {
+        target.draw(text);
+    }
+};
+
+// colours of the board and palette -- changing them means the cached geometry below has to be rebuilt
+struct BoardTheme {
+    sf::Color lightSquare = sf::Color(240, 217, 181);
+    sf::Color darkSquare = sf::Color(181, 136, 99);
+    sf::Color paletteBackground = sf::Color(60, 60, 60);
+    sf::Color boxFill = sf::Color(100, 100, 100);
+    sf::Color boxOutline = sf::Color(200, 200, 200);
+};
+
+BoardTheme boardTheme;
+
+// the board squares and the palette boxes never move, so they are built once into vertex arrays and each drawn with
+// a single draw call, instead of 64 + 13 RectangleShapes every frame. they are in layout units, so a resize doesn't
+// touch them -- rebuilt only when the theme or the board grid changes. the squares of every board in the grid are
+// one array, and where the GPU driver supports it they are uploaded once into a static vertex buffer, so even 16
+// boards (6144 vertices) are one draw call that sends nothing per frame
+sf::VertexArray boardGeometry(sf::PrimitiveType::Triangles);
+sf::VertexBuffer boardBuffer(sf::PrimitiveType::Triangles, sf::VertexBuffer::Usage::Static);
+bool boardBufferReady = false;
+sf::VertexArray paletteGeometry(sf::PrimitiveType::Triangles);
+bool staticGeometryDirty = true;
+
+void setBoardTheme(const BoardTheme& theme) {
+    boardTheme = theme;
+    staticGeometryDirty = true;
+}
+
+// switches the layout to count boards: 1, 4, 9 or 16
+void setBoardCount(int count) {
+    BoardGrid grid;
+    grid.count = count;
+    grid.columns = max(1, (int)lround(sqrt((double)count)));
+    grid.gap = grid.columns > 1 ? 12 : 0;
+    grid.squareSize = (BOARD_SIZE - grid.gap * (grid.columns - 1)) / grid.columns / 8;
+    grid.boardSize = grid.squareSize * 8;
+    grid.margin = (BOARD_SIZE - grid.boardSize * grid.columns - grid.gap * (grid.columns - 1)) / 2;
+    boardGrid = grid;
+    staticGeometryDirty = true;
+}
+
+// two triangles covering an axis aligned rectangle
+void appendQuad(sf::VertexArray& vertices, sf::Vector2f position, sf::Vector2f size, sf::Color color) {
+    sf::Vector2f topRight(position.x + size.x, position.y);
+    sf::Vector2f bottomLeft(position.x, position.y + size.y);
+    sf::Vector2f bottomRight(position.x + size.x, position.y + size.y);
+    vertices.append(sf::Vertex{position, color});
+    vertices.append(sf::Vertex{topRight, color});
+    vertices.append(sf::Vertex{bottomLeft, color});
+    vertices.append(sf::Vertex{bottomLeft, color});
+    vertices.append(sf::Vertex{topRight, color});
+    vertices.append(sf::Vertex{bottomRight, color});
+}
+
+void buildStaticGeometry() {
+    boardGeometry.clear();
+    float square = boardGrid.squareSize;
+    for (int board = 0; board < boardGrid.count; board++) {
+        sf::Vector2f origin = boardGrid.boardOrigin(board);
+        for (int rank = 0; rank < 8; rank++) {
+            for (int file = 0; file < 8; file++) {
+                sf::Color color = ((rank + file) % 2 == 0) ? boardTheme.lightSquare : boardTheme.darkSquare;
+                appendQuad(boardGeometry, origin + sf::Vector2f(file * square, rank * square),
+                           sf::Vector2f(square, square), color);
+            }
+        }
+    }
+    boardBufferReady = sf::VertexBuffer::isAvailable() && boardBuffer.create(boardGeometry.getVertexCount()) &&
+                       boardBuffer.update(&boardGeometry[0]);
+
+    paletteGeometry.clear();
+    // palette background starting at 800, 0, top right of the chess board
+    appendQuad(paletteGeometry, sf::Vector2f(BOARD_SIZE, 0), sf::Vector2f(PALETTE_WIDTH, WINDOW_HEIGHT),
+               boardTheme.paletteBackground);
+    for (int i = 0; i < 12; i++) {
+        // the boxes that will hold the pieces: a slightly bigger outline quad with the box drawn on top of it,
+        // which looks the same as a RectangleShape with a 2px outline
+        sf::Vector2f boxPosition(BOARD_SIZE + 10, 10 + i * 65);
+        appendQuad(paletteGeometry, boxPosition - sf::Vector2f(2, 2), sf::Vector2f(84, 64), boardTheme.boxOutline);
+        appendQuad(paletteGeometry, boxPosition, sf::Vector2f(80, 60), boardTheme.boxFill);
+    }
+
+    staticGeometryDirty = false;
+}
+
+// drawing the chess board and painting it black and white
+void draw_board(sf::RenderTarget& target) {
+    PROFILE_SCOPE("draw_board");
+    if (staticGeometryDirty) {
+        buildStaticGeometry();
+    }
+    if (boardBufferReady) {
+        target.draw(boardBuffer);
+    } else {
+        target.draw(boardGeometry);
+    }
+}
+
+// drawing palette to the right of the board
+void drawPalette(sf::RenderTarget& target, const sf::Text& instructions) {
+    PROFILE_SCOPE("drawPalette");
+    if (staticGeometryDirty) {
+        buildStaticGeometry();
+    }
+    target.draw(paletteGeometry);
+    target.draw(instructions);
+}
+
+// every piece drawn this frame, as textured quads into the atlas. refilled each frame and drawn once by drawPieceBatch,
+// clearing keeps the allocation so this doesn't allocate after the first frame
+sf::VertexArray pieceBatch(sf::PrimitiveType::Triangles);
+
+// one piece image stretched over the rectangle at position, size
+void appendPiece(sf::VertexArray& vertices, piece_type type, sf::Vector2f position, sf::Vector2f size) {
+    const sf::FloatRect& uv = pieceAtlasRects[type];
+    sf::Vector2f corners[4] = {position, sf::Vector2f(position.x + size.x, position.y),
+                               sf::Vector2f(position.x, position.y + size.y), position + size};
+    sf::Vector2f uvCorners[4] = {uv.position, sf::Vector2f(uv.position.x + uv.size.x, uv.position.y),
+                                 sf::Vector2f(uv.position.x, uv.position.y + uv.size.y), uv.position + uv.size};
+    // two triangles: top left, top right, bottom left and bottom left, top right, bottom right
+    for (int corner : {0, 1, 2, 2, 1, 3}) {
+        vertices.append(sf::Vertex{corners[corner], sf::Color::White, uvCorners[corner]});
+    }
+}
+
+// add the pieces on the board to the batch, drawn on board gridIndex of the grid. every board's pieces go into the
+// same batch, so the pieces of the whole grid are still one draw call
+void appendBoardPieces(sf::VertexArray& vertices, const board_state& board, int gridIndex = 0) {
+    PROFILE_SCOPE("appendBoardPieces");
+    sf::Vector2f origin = boardGrid.boardOrigin(gridIndex);
+    float square = boardGrid.squareSize;
+    // only visit occupied squares of each bitboard -- lowest_bit_index jumps straight to the next piece
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        for (unsigned long long bits = board.get_bitboard((piece_type)type); bits != 0; bits &= bits - 1) {
+            int squareIndex = lowest_bit_index(bits);
+            
+            int file = squareIndex % 8;
+            int rank = squareIndex / 8;
+            
+            appendPiece(vertices, (piece_type)type, origin + sf::Vector2f(file * square, rank * square),
+                        sf::Vector2f(square, square));
+        }
+    }
+}
+
+// a frame of the given colour around board gridIndex, in the gap between the boards -- marks which boards of a grid
+// were right after a check. untextured, so it goes in a batch of its own
+void appendBoardOutline(sf::VertexArray& vertices, int gridIndex, sf::Color color) {
+    const float thickness = 4;
+    sf::Vector2f origin = boardGrid.boardOrigin(gridIndex) - sf::Vector2f(thickness, thickness);
+    float outer = boardGrid.boardSize + 2 * thickness;
+    appendQuad(vertices, origin, sf::Vector2f(outer, thickness), color);
+    appendQuad(vertices, origin + sf::Vector2f(0, outer - thickness), sf::Vector2f(outer, thickness), color);
+    appendQuad(vertices, origin + sf::Vector2f(0, thickness), sf::Vector2f(thickness, outer - 2 * thickness), color);
+    appendQuad(vertices, origin + sf::Vector2f(outer - thickness, thickness),
+               sf::Vector2f(thickness, outer - 2 * thickness), color);
+}
+
+// draw everything in the batch with the atlas bound once
+void drawPieceBatch(sf::RenderTarget& target, const sf::VertexArray& vertices) {
+    PROFILE_SCOPE("drawPieceBatch");
+    sf::RenderStates states;
+    states.texture = &pieceAtlas;
+    target.draw(vertices, states);
+}
+
+// a mouse position in window pixels as whole layout units, through the layout of the last resize
+sf::Vector2i mouseToLayout(sf::Vector2i mouse) {
+    sf::Vector2f point = screenLayout.toLayout(mouse);
+    return sf::Vector2i((int)floor(point.x), (int)floor(point.y));
+}
+
+// check if mouse is in palette and return piece if clicked
+char getPieceFromPalette(sf::Vector2i mouse) {
+    sf::Vector2i point = mouseToLayout(mouse);
+    int mouseX = point.x, mouseY = point.y;
+    if (mouseX < BOARD_SIZE || mouseX > BOARD_SIZE + PALETTE_WIDTH) return ' ';
+    
+    char pieces[] = {'K', 'Q', 'R', 'B', 'N', 'P', 'k', 'q', 'r', 'b', 'n', 'p'};
+    
+    for (int i = 0; i < 12; i++) {
+        int boxX = BOARD_SIZE + 10;
+        int boxY = 10 + i * 65;
+        
+        // each box we drew is 80x60 so we are checking if our mouse is within this range
+        if (mouseX >= boxX && mouseX <= boxX + 80 &&
+            mouseY >= boxY && mouseY <= boxY + 60) {
+            return pieces[i];
+        }
+    }
+    
+    return ' ';
+}
+
+// convert mouse coordinates to square index, and the board of the grid it is on into board if that's given
+int getSquareFromMouse(sf::Vector2i mouse, int* board = nullptr) {
+    sf::Vector2i point = mouseToLayout(mouse);
+    int mouseX = point.x, mouseY = point.y;
+    // once we are sure we are in the board area then only run the calculations of figuring out what square we are in
+    int x = mouseX - boardGrid.margin, y = mouseY - boardGrid.margin;
+    if (x < 0 || mouseX >= BOARD_SIZE || y < 0 || mouseY >= BOARD_SIZE) return -1;
+    
+    // which cell of the grid, then where inside that cell's board -- the gaps between boards are no square at all
+    int step = boardGrid.boardSize + boardGrid.gap;
+    int column = x / step, row = y / step;
+    x -= column * step;
+    y -= row * step;
+    if (column >= boardGrid.columns || row >= boardGrid.columns) return -1;
+    if (x >= boardGrid.boardSize || y >= boardGrid.boardSize) return -1;
+    if (board != nullptr) {
+        *board = row * boardGrid.columns + column;
+    }
+    
+    int file = x / boardGrid.squareSize;
+    int rank = y / boardGrid.squareSize;
+    return rank * 8 + file;
+}
+
+// add the piece being dragged to the batch -- last, so it ends up on top
+void appendDraggedPiece(sf::VertexArray& vertices, char piece, sf::Vector2f position) {
+    if (piece == ' ') return;
+    
+    // center the piece on the cursor, the size of a square of the boards on screen
+    float square = boardGrid.squareSize;
+    appendPiece(vertices, piece_type_of(piece),
+                sf::Vector2f(position.x - square/2, position.y - square/2),
+                sf::Vector2f(square, square));
+}
+
+// add the piece images inside the palette boxes to the batch
+void appendPalettePieces(sf::VertexArray& vertices) {
+    PROFILE_SCOPE("appendPalettePieces");
+    char pieces[] = {'K', 'Q', 'R', 'B', 'N', 'P', 'k', 'q', 'r', 'b', 'n', 'p'};
+    
+    for (int i = 0; i < 12; i++) {
+        piece_type type = piece_type_of(pieces[i]);
+        
+        // scale to fit in the box (50 pixels wide for 80x60 box)
+        const sf::FloatRect& uv = pieceAtlasRects[type];
+        sf::Vector2f size(50.0f, 50.0f * uv.size.y / uv.size.x);
+        
+        // center in the box
+        // offset is (15, 10) within the boxes that we drew earlier 
+        appendPiece(vertices, type, sf::Vector2f(BOARD_SIZE + 25, 20 + i * 65), size);
+    }
+}
+
+// (re)creates a frame for renderPuzzleFrame at the window's resolution, BOARD_SIZE layout units square, so showing a
+// frame is as sharp as drawing the board directly
+bool resizePuzzleFrame(sf::RenderTexture& frame) {
+    unsigned pixels = (unsigned)lround(BOARD_SIZE * screenLayout.scale);
+    if (!frame.resize(sf::Vector2u(pixels, pixels))) {
+        return false;
+    }
+    frame.setView(sf::View(sf::FloatRect(sf::Vector2f(0, 0), sf::Vector2f(BOARD_SIZE, BOARD_SIZE))));
+    return true;
+}
+
+// shows a frame over the board, one frame pixel per window pixel
+void drawPuzzleFrame(sf::RenderTarget& target, const sf::RenderTexture& frame) {
+    sf::Sprite sprite(frame.getTexture());
+    float scale = (float)BOARD_SIZE / frame.getSize().x;
+    sprite.setScale(sf::Vector2f(scale, scale));
+    target.draw(sprite);
+}
+
+// draws the board and the pieces of a position into an offscreen texture, so showing it later is one sprite draw
+// has to run on the thread that owns the window's GL context, like all other drawing
+void renderPuzzleFrame(sf::RenderTexture& target, const board_state& board) {
+    PROFILE_SCOPE("renderPuzzleFrame");
+    static sf::VertexArray frameBatch(sf::PrimitiveType::Triangles);
+    target.clear(sf::Color(40, 40, 40));
+    draw_board(target);
+    frameBatch.clear();
+    appendBoardPieces(frameBatch, board);
+    drawPieceBatch(target, frameBatch);
+    target.display();
+}
@@ -1,45 +1,210 @@
+#pragma once
+
 #include <cctype>
+#include <functional>
 #include <iostream>
+#include <string_view>
+#include "bitboard_utils.cpp"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 // We will be representing the position on the chess board using a 12-bitboard strategy
 
+// which of the 12 bitboards a piece lives on. same order as the piece codes in a position pack
+enum piece_type {
+    WHITE_PAWN, WHITE_KNIGHT, WHITE_BISHOP, WHITE_ROOK, WHITE_QUEEN, WHITE_KING,
+    BLACK_PAWN, BLACK_KNIGHT, BLACK_BISHOP, BLACK_ROOK, BLACK_QUEEN, BLACK_KING,
+    PIECE_TYPES
+};
+
+// FEN letter of every piece_type
+constexpr char PIECE_CHARS[PIECE_TYPES] = {'P', 'N', 'B', 'R', 'Q', 'K', 'p', 'n', 'b', 'r', 'q', 'k'};
+
+// which bitboard a FEN letter belongs on, or PIECE_TYPES if it isn't a piece
+inline piece_type piece_type_of(char piece) {
+    switch (piece) {
+        case 'P': return WHITE_PAWN;
+        case 'N': return WHITE_KNIGHT;
+        case 'B': return WHITE_BISHOP;
+        case 'R': return WHITE_ROOK;
+        case 'Q': return WHITE_QUEEN;
+        case 'K': return WHITE_KING;
+        case 'p': return BLACK_PAWN;
+        case 'n': return BLACK_KNIGHT;
+        case 'b': return BLACK_BISHOP;
+        case 'r': return BLACK_ROOK;
+        case 'q': return BLACK_QUEEN;
+        case 'k': return BLACK_KING;
+        default: return PIECE_TYPES;
+    }
+}
+
+// zobrist hashing: a fixed random key for every (piece type, square) pair, and a position hashes to the xor of the keys
+// of everything on the board. placing or removing one piece is then a single xor, so the hash is always up to date
+struct zobrist_table {
+    unsigned long long keys[PIECE_TYPES][64];
+};
+
+constexpr zobrist_table make_zobrist_table() {
+    // splitmix64 from a fixed seed, so hashes are the same in every build and can be stored in files
+    zobrist_table table = {};
+    unsigned long long state = 0x4d656d6f72794368ULL;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        for (int square = 0; square < 64; square++) {
+            state += 0x9E3779B97F4A7C15ULL;
+            unsigned long long key = state;
+            key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+            table.keys[type][square] = key ^ (key >> 31);
+        }
+    }
+    return table;
+}
+
+constexpr zobrist_table ZOBRIST_KEYS = make_zobrist_table();
+
+// hash of a position given as 12 bitboards indexed by piece_type, matching board_state::get_hash
+inline unsigned long long zobrist_hash(const unsigned long long* boards) {
+    unsigned long long hash = 0ULL;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        for (unsigned long long squares = boards[type]; squares != 0; squares &= squares - 1) {
+            hash ^= ZOBRIST_KEYS.keys[type][lowest_bit_index(squares)];
+        }
+    }
+    return hash;
+}
+
+// what every byte means to the FEN placement parser: which bitboard it sets (PIECE_TYPES, a scratch board, for
+// anything that isn't a piece), how many squares it moves along (1 for a piece, 1-8 for a digit), and flags for the
+// '/' between ranks, the ' ' that ends the placement field, and characters that may not appear at all
+const uint8_t FEN_RANK_END = 1;
+const uint8_t FEN_FIELD_END = 2;
+const uint8_t FEN_INVALID = 4;
+
+struct fen_char_table {
+    uint8_t type[256];
+    uint8_t advance[256];
+    uint8_t flags[256];
+};
+
+constexpr fen_char_table make_fen_char_table() {
+    fen_char_table table = {};
+    for (int c = 0; c < 256; c++) {
+        table.type[c] = PIECE_TYPES;
+        table.advance[c] = 0;
+        table.flags[c] = FEN_INVALID;
+    }
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        unsigned char c = (unsigned char)PIECE_CHARS[type];
+        table.type[c] = (uint8_t)type;
+        table.advance[c] = 1;
+        table.flags[c] = 0;
+    }
+    for (int run = 1; run <= 8; run++) {
+        table.advance['0' + run] = (uint8_t)run;
+        table.flags['0' + run] = 0;
+    }
+    table.flags['/'] = FEN_RANK_END;
+    table.flags[' '] = FEN_FIELD_END;
+    return table;
+}
+
+constexpr fen_char_table FEN_CHAR_TABLE = make_fen_char_table();
+
+// parses the placement field of a FEN (everything up to the first space) into 12 bitboards indexed by piece_type
+// every character is three table lookups and no data dependent branches: mistakes are or-ed into an error flag
+// instead of tested one by one. every rank has to add up to exactly 8 squares, so a malformed row is rejected
+// instead of running square numbers past 63. works at compile time too
+constexpr bool parse_fen_placement(string_view fen, unsigned long long (&boards)[PIECE_TYPES]) {
+    unsigned long long found[PIECE_TYPES + 1] = {};
+    int square = 0;
+    int ranks = 1;
+    int error = 0;
+    for (char c : fen) {
+        unsigned char index = (unsigned char)c;
+        uint8_t flags = FEN_CHAR_TABLE.flags[index];
+        if (flags & FEN_FIELD_END) {
+            break;
+        }
+        int rank_end = flags & FEN_RANK_END;
+        // a '/' is only allowed once the current rank is exactly full
+        error |= (flags & FEN_INVALID) | (rank_end & (square != 8 * ranks));
+        ranks += rank_end;
+        found[FEN_CHAR_TABLE.type[index]] |= 1ULL << (square & 63);
+        square += FEN_CHAR_TABLE.advance[index];
+        error |= square > 8 * ranks;
+    }
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        boards[type] = found[type];
+    }
+    return error == 0 && ranks == 8 && square == 64;
+}
+
+constexpr bool is_valid_fen_placement(string_view fen) {
+    unsigned long long scratch[PIECE_TYPES] = {};
+    return parse_fen_placement(fen, scratch);
+}
+
+static_assert(is_valid_fen_placement("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"), "start position must parse");
+static_assert(!is_valid_fen_placement("rnbqkbnr/pppppppp/9/8/8/8/PPPPPPPP/RNBQKBNR w"), "9 is not a valid run");
+static_assert(!is_valid_fen_placement("rnbqkbnr/ppppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w"), "rank with 9 squares");
+static_assert(!is_valid_fen_placement("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP w"), "only 7 ranks");
+
+// result of grading a reconstruction against the solution, one bit per square in each mask
+struct score_breakdown {
+    uint32_t correct;
+    // the solution has a piece here but the user left the square empty
+    unsigned long long missing;
+    // the user put a piece on a square that should be empty
+    unsigned long long extra;
+    // both boards have a piece here, but not the same one
+    unsigned long long wrong;
+};
+
 class board_state {
     private: 
 
-    unsigned long long whitePawns = 0ULL;
-    unsigned long long whiteKnights = 0ULL;
-    unsigned long long whiteBishops = 0ULL;
-    unsigned long long whiteRooks = 0ULL;
-    unsigned long long whiteQueens = 0ULL;
-    unsigned long long whiteKing = 0ULL;
-    unsigned long long blackPawns = 0ULL;
-    unsigned long long blackKnights = 0ULL;
-    unsigned long long blackBishops = 0ULL;
-    unsigned long long blackRooks = 0ULL;
-    unsigned long long blackQueens = 0ULL;
-    unsigned long long blackKing = 0ULL;
+    // one bitboard per piece type, indexed by piece_type. kept as an array so comparisons can loop (or vectorize)
+    // over all twelve instead of spelling each one out
+    alignas(32) unsigned long long bitboards[PIECE_TYPES] = {};
+
+    // every occupied square, whatever is on it -- lets callers jump straight from one piece to the next
+    unsigned long long occupied = 0ULL;
+
+    // the same position again as one FEN letter per square (' ' for empty), kept in sync with the bitboards
+    // so asking what is on a square is one array read instead of a walk over all twelve bitboards
+    char mailbox[64];
+
+    // zobrist hash of the position, updated by every placement and removal
+    unsigned long long hash = 0ULL;
 
     // this method will be called when the user is placing the pieces onto the board during the puzzle. 
-    void set_bit(unsigned long long& bitboard, int square_index) {
-        bitboard |= (1ULL << square_index);
+    // the square has to be empty already
+    void place_piece(piece_type type, int square_index) {
+        if (square_index < 0 || square_index >= 64) {
+            return;
+        }
+        unsigned long long bit = 1ULL << square_index;
+        bitboards[type] |= bit;
+        occupied |= bit;
+        mailbox[square_index] = PIECE_CHARS[type];
+        hash ^= ZOBRIST_KEYS.keys[type][square_index];
     }
 
     // void clear all bitboards -- for when a puzzle is reset 
     void clear_all_bitboards() {
-        whitePawns = 0ULL;
-        whiteKnights = 0ULL;
-        whiteBishops = 0ULL;
-        whiteRooks = 0ULL;
-        whiteQueens = 0ULL;
-        whiteKing = 0ULL;
-        blackPawns = 0ULL;
-        blackKnights = 0ULL;
-        blackBishops = 0ULL;
-        blackRooks = 0ULL;
-        blackQueens = 0ULL;
-        blackKing = 0ULL;
+        for (unsigned long long& bitboard : bitboards) {
+            bitboard = 0ULL;
+        }
+        occupied = 0ULL;
+        hash = 0ULL;
+        for (char& square : mailbox) {
+            square = ' ';
+        }
     }
 
     // this method is a helper that directly checks the bitboards to see if the piece is there
@@ -62,181 +227,203 @@ class board_state {
         // 1ULL : (63 zeroes)1
         // left shift it by the square index, lets say it is 3, so we are on d8 or smth
         // make every digit in the bit string equal to its opposite value, so we have all 1s and then a 0 in the 3rd position
-        // then we &= every bitboard with this mask, so all the values not in position 3 will retain their original value but position 3 will become 0 
+        // then we &= the bitboard with this mask, so all the values not in position 3 will retain their original value but position 3 will become 0 
+        // the mailbox tells us which bitboard the piece is on, so only that one needs touching
+        if (square_index < 0 || square_index >= 64) {
+            return;
+        }
+        char piece = mailbox[square_index];
+        if (piece == ' ') {
+            return;
+        }
         unsigned long long mask = ~(1ULL << square_index);
-        whitePawns &= mask;
-        whiteKnights &= mask;
-        whiteBishops &= mask;
-        whiteRooks &= mask;
-        whiteQueens &= mask;
-        whiteKing &= mask;
-        blackPawns &= mask;
-        blackKnights &= mask;
-        blackBishops &= mask;
-        blackRooks &= mask;
-        blackQueens &= mask;
-        blackKing &= mask;
+        piece_type type = piece_type_of(piece);
+        bitboards[type] &= mask;
+        hash ^= ZOBRIST_KEYS.keys[type][square_index];
+        occupied &= mask;
+        mailbox[square_index] = ' ';
     }
 
     public: 
 
-    board_state() = default; 
-
-    void populate_from_FEN(string& FEN_string) {
-
+    board_state() {
         clear_all_bitboards();
+    }
 
-        int square_number = 0; 
-
-        for (char c : FEN_string) {
-
-            if (c == ' ') {
-                break;
-            }
-
-            if (c == '/') {
-                continue; 
-            }
+    // takes a view so FENs can be parsed straight out of the memory mapped csv without copying them
+    // returns false (and leaves the board empty) if the placement field is malformed
+    bool populate_from_FEN(string_view FEN_string) {
+        unsigned long long parsed[PIECE_TYPES];
+        if (!parse_fen_placement(FEN_string, parsed)) {
+            clear_all_bitboards();
+            return false;
+        }
+        set_bitboards(parsed);
+        return true;
+    }
 
-            // handling the digits representing empty squares. we convert to integer by subtracting ASCII values of both characters. 
-            if (isdigit(c)) {
-                square_number += (c - '0');
+    // replaces the whole position with the given 12 bitboards (indexed by piece_type), which must not overlap
+    void set_bitboards(const unsigned long long* boards) {
+        clear_all_bitboards();
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            bitboards[type] = boards[type];
+            occupied |= boards[type];
+            for (unsigned long long squares = boards[type]; squares != 0; squares &= squares - 1) {
+                int square = lowest_bit_index(squares);
+                mailbox[square] = PIECE_CHARS[type];
+                hash ^= ZOBRIST_KEYS.keys[type][square];
             }
+        }
+    }
 
-            else {
-                // black rook 
-                if (c == 'r') {
-                    set_bit(blackRooks, square_number);
-                    square_number++;
-                }
-                // black knight
-                if (c == 'n') {
-                    set_bit(blackKnights, square_number);
-                    square_number++;
-                }
-                // black bishop 
-                if (c == 'b') {
-                    set_bit(blackBishops, square_number);
-                    square_number++;
-                }
-                // black queen
-                if (c == 'q') {
-                    set_bit(blackQueens, square_number);
-                    square_number++;
-                }
-                // black king
-                if (c == 'k') {
-                    set_bit(blackKing, square_number);
-                    square_number++;
-                }
-                // white rook 
-                if (c == 'R') {
-                    set_bit(whiteRooks, square_number);
-                    square_number++;
-                }
-                // white knight
-                if (c == 'N') {
-                    set_bit(whiteKnights, square_number);
-                    square_number++;
-                }
-                // white bishop
-                if (c == 'B') {
-                    set_bit(whiteBishops, square_number);
-                    square_number++;
-                }
-                // white queen 
-                if (c == 'Q') {
-                    set_bit(whiteQueens, square_number);
-                    square_number++;
-                }
-                // white king 
-                if (c == 'K') {
-                    set_bit(whiteKing, square_number);
-                    square_number++;
-                }
-                // black pawn 
-                if (c == 'p') {
-                    set_bit(blackPawns, square_number);
-                    square_number++;
-                }
-                // white pawn 
-                if (c == 'P') {
-                    set_bit(whitePawns, square_number);
-                    square_number++;
-                }
-            }
+    // rebuilds the board from its occupied squares plus a 4 bit piece_type code per occupied square, in square order,
+    // two per byte, low nibble first (the piece encoding of position packs). one pass over the pieces that fills the
+    // bitboards, mailbox and hash together, which is what keeps unpacking stored positions cheap
+    // codes that aren't a piece_type leave their square empty
+    void set_packed_pieces(unsigned long long occupancy, const uint8_t* pieces) {
+        clear_all_bitboards();
+        int count = 0;
+        for (unsigned long long squares = occupancy; squares != 0; squares &= squares - 1) {
+            int code = (pieces[count / 2] >> ((count % 2) * 4)) & 0xF;
+            count++;
+            if (code >= PIECE_TYPES) continue;
+            int square = lowest_bit_index(squares);
+            bitboards[code] |= 1ULL << square;
+            mailbox[square] = PIECE_CHARS[code];
+            hash ^= ZOBRIST_KEYS.keys[code][square];
+        }
+        for (const unsigned long long& bitboard : bitboards) {
+            occupied |= bitboard;
         }
     }
 
+    // zobrist hash of the placement (side to move, castling and so on aren't part of a board_state)
+    // equal boards always hash equal, so this is a cheap first check before operator==
+    unsigned long long get_hash() const {
+        return hash;
+    }
+
+    // ' ' for an empty square
     char get_piece_at(uint32_t square_index) const {
-        // check black pieces 
-        if (is_set(blackRooks, square_index)) return 'r';
-        if (is_set(blackKnights, square_index)) return 'n';
-        if (is_set(blackBishops, square_index)) return 'b';
-        if (is_set(blackQueens, square_index)) return 'q';
-        if (is_set(blackKing, square_index)) return 'k';
-        if (is_set(blackPawns, square_index)) return 'p';
-        
-        // check white pieces
-        if (is_set(whiteRooks, square_index)) return 'R';
-        if (is_set(whiteKnights, square_index)) return 'N';
-        if (is_set(whiteBishops, square_index)) return 'B';
-        if (is_set(whiteQueens, square_index)) return 'Q';
-        if (is_set(whiteKing, square_index)) return 'K';
-        if (is_set(whitePawns, square_index)) return 'P';
-        
-        // empty square
-        return ' ';
+        return mailbox[square_index];
     }
 
     // both boards are to remain constant when this operator is used
     // now we can compare two entire chess boards directly
     bool operator==(const board_state&  other) const {
-        return (whitePawns == other.whitePawns) &&
-        (whiteKnights == other.whiteKnights) &&
-        (whiteBishops == other.whiteBishops) &&
-        (whiteRooks == other.whiteRooks) &&
-        (whiteQueens == other.whiteQueens) &&
-        (whiteKing == other.whiteKing) &&
-        (blackPawns == other.blackPawns) &&
-        (blackKnights == other.blackKnights) &&
-        (blackBishops == other.blackBishops) &&
-        (blackRooks == other.blackRooks) &&
-        (blackQueens == other.blackQueens) &&
-        (blackKing == other.blackKing);
+        unsigned long long difference = 0ULL;
+        for (int i = 0; i < PIECE_TYPES; i++) {
+            difference |= bitboards[i] ^ other.bitboards[i];
+        }
+        return difference == 0ULL;
     }
 
-    uint32_t how_many_squares_correct(const board_state& target) const {
-        int correct = 0;
+    // every square with a piece on it, whatever the piece. walk it with lowest_bit_index to visit only occupied squares
+    unsigned long long occupancy() const {
+        return occupied;
+    }
 
-        for (int i = 0; i < 64; i++) {
-            if (get_piece_at(i) == target.get_piece_at(i)) {
-                correct += 1;
-            }
+    unsigned long long get_bitboard(piece_type type) const {
+        return bitboards[type];
+    }
+
+    // all twelve, indexed by piece_type
+    const unsigned long long* get_bitboards() const {
+        return bitboards;
+    }
+
+    // one bit for every square whose contents differ between the two boards
+    // a square holding different pieces (or a piece on only one board) flips a bit in at least one of the xors,
+    // so or-ing the twelve xors together gives the whole answer without looking at a single square
+    unsigned long long difference_mask(const board_state& other) const {
+#ifdef __AVX2__
+        // 12 bitboards are exactly three 256 bit registers per board
+        __m256i difference = _mm256_setzero_si256();
+        for (int i = 0; i < PIECE_TYPES; i += 4) {
+            __m256i mine = _mm256_load_si256(reinterpret_cast<const __m256i*>(bitboards + i));
+            __m256i theirs = _mm256_load_si256(reinterpret_cast<const __m256i*>(other.bitboards + i));
+            difference = _mm256_or_si256(difference, _mm256_xor_si256(mine, theirs));
+        }
+        __m128i folded = _mm_or_si128(_mm256_castsi256_si128(difference), _mm256_extracti128_si256(difference, 1));
+        return (unsigned long long)(_mm_cvtsi128_si64(folded) | _mm_extract_epi64(folded, 1));
+#else
+        unsigned long long difference = 0ULL;
+        for (int i = 0; i < PIECE_TYPES; i++) {
+            difference |= bitboards[i] ^ other.bitboards[i];
         }
-        return correct; 
+        return difference;
+#endif
+    }
+
+    uint32_t how_many_squares_correct(const board_state& target) const {
+        return 64 - popcount64(difference_mask(target));
     }
 
-    // the purpose of this method is to clear all 12 bit boards and place the piece on the correct one
+    // same grading as how_many_squares_correct, split into what kind of mistake each wrong square is
+    score_breakdown score_against(const board_state& target) const {
+        unsigned long long difference = difference_mask(target);
+        unsigned long long mine = occupancy();
+        unsigned long long theirs = target.occupancy();
+
+        score_breakdown score;
+        score.correct = 64 - popcount64(difference);
+        score.missing = theirs & ~mine;
+        score.extra = mine & ~theirs;
+        score.wrong = difference & mine & theirs;
+        return score;
+    }
+
+    // moves the piece on from (there has to be one) to to, taking whatever was on to off the board -- a chess move
+    // without any of the rules, which move_generator.cpp adds on top
+    void move_piece(int from, int to) {
+        clear_square(to);
+        char piece = mailbox[from];
+        piece_type type = piece_type_of(piece);
+        unsigned long long bits = (1ULL << from) | (1ULL << to);
+        bitboards[type] ^= bits;
+        occupied ^= bits;
+        mailbox[from] = ' ';
+        mailbox[to] = piece;
+        hash ^= ZOBRIST_KEYS.keys[type][from] ^ ZOBRIST_KEYS.keys[type][to];
+    }
+
+    // the purpose of this method is to take whatever was on the square off its bit board and place the piece on the correct one
     // high level view of adding a piece to a square 
     void set_piece_at_square(int square_index, char piece) {
         clear_square(square_index);
         
         switch (piece) {
-            case 'P': set_bit(whitePawns, square_index); break;
-            case 'N': set_bit(whiteKnights, square_index); break;
-            case 'B': set_bit(whiteBishops, square_index); break;
-            case 'R': set_bit(whiteRooks, square_index); break;
-            case 'Q': set_bit(whiteQueens, square_index); break;
-            case 'K': set_bit(whiteKing, square_index); break;
-            case 'p': set_bit(blackPawns, square_index); break;
-            case 'n': set_bit(blackKnights, square_index); break;
-            case 'b': set_bit(blackBishops, square_index); break;
-            case 'r': set_bit(blackRooks, square_index); break;
-            case 'q': set_bit(blackQueens, square_index); break;
-            case 'k': set_bit(blackKing, square_index); break;
+            case 'P': place_piece(WHITE_PAWN, square_index); break;
+            case 'N': place_piece(WHITE_KNIGHT, square_index); break;
+            case 'B': place_piece(WHITE_BISHOP, square_index); break;
+            case 'R': place_piece(WHITE_ROOK, square_index); break;
+            case 'Q': place_piece(WHITE_QUEEN, square_index); break;
+            case 'K': place_piece(WHITE_KING, square_index); break;
+            case 'p': place_piece(BLACK_PAWN, square_index); break;
+            case 'n': place_piece(BLACK_KNIGHT, square_index); break;
+            case 'b': place_piece(BLACK_BISHOP, square_index); break;
+            case 'r': place_piece(BLACK_ROOK, square_index); break;
+            case 'q': place_piece(BLACK_QUEEN, square_index); break;
+            case 'k': place_piece(BLACK_KING, square_index); break;
             case ' ': break;
         }
     }
 
-};
\ No newline at end of file
+};
+
+// lets board_state be used as a key in unordered_set / unordered_map
+namespace std {
+    template <>
+    struct hash<board_state> {
+        size_t operator()(const board_state& board) const noexcept {
+            return (size_t)board.get_hash();
+        }
+    };
+}
+
+// grades count reconstructions against their solutions in one go, writing the number of correct squares for each
+void grade_many(const board_state* user_boards, const board_state* solutions, uint32_t* correct, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        correct[i] = user_boards[i].how_many_squares_correct(solutions[i]);
+    }
+}
\ No newline at end of file
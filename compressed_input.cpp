@@ -0,0 +1,355 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef MEMORY_CHESS_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MEMORY_CHESS_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+// reading the puzzle csv straight out of the compressed lichess download (lichess_db_puzzle.csv.zst, or a .gz)
+// without ever having the whole decompressed file anywhere: one thread decompresses into a fixed set of blocks while
+// another splits the rows out of the blocks it has been handed, so the two overlap and memory stays the same
+// however big the file is
+//
+// zstd needs MEMORY_CHESS_WITH_ZSTD and gzip MEMORY_CHESS_WITH_ZLIB (CMake defines them when it finds the libraries)
+// a file that is neither is read as it is, so a plain csv works through the same path
+
+// decompresses a file front to back, a buffer at a time. the format is told from the first bytes, not the name
+class decompressing_reader {
+    private:
+
+    enum input_format { FORMAT_PLAIN, FORMAT_GZIP, FORMAT_ZSTD };
+
+    FILE* file = nullptr;
+    input_format format = FORMAT_PLAIN;
+    uint64_t total_bytes = 0;
+    // compressed bytes taken from the file so far, for progress; read from other threads
+    atomic<uint64_t> consumed_bytes{0};
+    bool input_done = false;
+    bool error = false;
+    // in the middle of a gzip member or zstd frame -- running out of input then means the file was cut short
+    bool frame_open = false;
+
+    // compressed input waiting to be decompressed
+    vector<char> input;
+    size_t input_start = 0;
+    size_t input_end = 0;
+
+#ifdef MEMORY_CHESS_WITH_ZLIB
+    z_stream gzip_stream = {};
+    bool gzip_ready = false;
+#endif
+#ifdef MEMORY_CHESS_WITH_ZSTD
+    ZSTD_DCtx* zstd_context = nullptr;
+#endif
+
+    // tops up the input buffer once it has been used up. false at the end of the file
+    bool refill_input() {
+        if (input_start < input_end) {
+            return true;
+        }
+        if (input_done) {
+            return false;
+        }
+        input_start = 0;
+        input_end = fread(input.data(), 1, input.size(), file);
+        consumed_bytes.fetch_add(input_end, memory_order_relaxed);
+        if (input_end < input.size()) {
+            input_done = true;
+            error |= ferror(file) != 0;
+        }
+        return input_end > 0;
+    }
+
+    public:
+
+    decompressing_reader() = default;
+    decompressing_reader(const decompressing_reader&) = delete;
+    decompressing_reader& operator=(const decompressing_reader&) = delete;
+
+    ~decompressing_reader() {
+        close();
+    }
+
+    bool open(const string& filename) {
+        close();
+        file = fopen(filename.c_str(), "rb");
+        if (file == nullptr) {
+            cerr << "Error, we could not open the file: " << filename << endl;
+            return false;
+        }
+        fseek(file, 0, SEEK_END);
+        total_bytes = (uint64_t)ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        unsigned char magic[4] = {};
+        size_t magic_size = fread(magic, 1, sizeof(magic), file);
+        fseek(file, 0, SEEK_SET);
+        if (magic_size >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) {
+            format = FORMAT_GZIP;
+        }
+        else if (magic_size == 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD) {
+            format = FORMAT_ZSTD;
+        }
+
+        if (format == FORMAT_GZIP) {
+#ifdef MEMORY_CHESS_WITH_ZLIB
+            // 15 + 16: a gzip header rather than a raw zlib stream
+            gzip_ready = inflateInit2(&gzip_stream, 15 + 16) == Z_OK;
+            if (!gzip_ready) {
+                cerr << "Error, could not start decompressing: " << filename << endl;
+                close();
+                return false;
+            }
+            input.resize(1 << 18);
+#else
+            cerr << "Error, this build can't read gzip (built without zlib): " << filename << endl;
+            close();
+            return false;
+#endif
+        }
+        else if (format == FORMAT_ZSTD) {
+#ifdef MEMORY_CHESS_WITH_ZSTD
+            zstd_context = ZSTD_createDCtx();
+            if (zstd_context == nullptr) {
+                cerr << "Error, could not start decompressing: " << filename << endl;
+                close();
+                return false;
+            }
+            input.resize(ZSTD_DStreamInSize());
+#else
+            cerr << "Error, this build can't read zstd (built without libzstd): " << filename << endl;
+            close();
+            return false;
+#endif
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef MEMORY_CHESS_WITH_ZLIB
+        if (gzip_ready) inflateEnd(&gzip_stream);
+        gzip_stream = {};
+        gzip_ready = false;
+#endif
+#ifdef MEMORY_CHESS_WITH_ZSTD
+        if (zstd_context != nullptr) ZSTD_freeDCtx(zstd_context);
+        zstd_context = nullptr;
+#endif
+        if (file != nullptr) fclose(file);
+        file = nullptr;
+        format = FORMAT_PLAIN;
+        consumed_bytes.store(0);
+        input.clear();
+        input_start = input_end = 0;
+        input_done = false;
+        error = false;
+        frame_open = false;
+    }
+
+    // decompresses up to capacity bytes into out and returns how many. 0 means the end of the file, or an error if
+    // failed() says so
+    size_t read(char* out, size_t capacity) {
+        if (file == nullptr || error) {
+            return 0;
+        }
+        if (format == FORMAT_PLAIN) {
+            size_t size = fread(out, 1, capacity, file);
+            consumed_bytes.fetch_add(size, memory_order_relaxed);
+            error |= ferror(file) != 0;
+            return size;
+        }
+
+        size_t produced = 0;
+#ifdef MEMORY_CHESS_WITH_ZLIB
+        if (format == FORMAT_GZIP) {
+            while (produced < capacity && refill_input()) {
+                gzip_stream.next_in = reinterpret_cast<Bytef*>(input.data() + input_start);
+                gzip_stream.avail_in = (uInt)(input_end - input_start);
+                gzip_stream.next_out = reinterpret_cast<Bytef*>(out + produced);
+                gzip_stream.avail_out = (uInt)(capacity - produced);
+                int result = inflate(&gzip_stream, Z_NO_FLUSH);
+                input_start = input_end - gzip_stream.avail_in;
+                produced = capacity - gzip_stream.avail_out;
+                frame_open = result != Z_STREAM_END;
+                if (result == Z_STREAM_END) {
+                    // gzip files may be several members back to back, each one its own stream
+                    inflateReset(&gzip_stream);
+                }
+                else if (result != Z_OK && result != Z_BUF_ERROR) {
+                    error = true;
+                    break;
+                }
+            }
+        }
+#endif
+#ifdef MEMORY_CHESS_WITH_ZSTD
+        if (format == FORMAT_ZSTD) {
+            while (produced < capacity && refill_input()) {
+                ZSTD_inBuffer in = {input.data(), input_end, input_start};
+                ZSTD_outBuffer output = {out, capacity, produced};
+                size_t result = ZSTD_decompressStream(zstd_context, &output, &in);
+                input_start = in.pos;
+                produced = output.pos;
+                if (ZSTD_isError(result)) {
+                    error = true;
+                    break;
+                }
+                // 0 once a frame is complete and flushed
+                frame_open = result != 0;
+            }
+        }
+#endif
+        if (produced < capacity && frame_open && input_done && input_start == input_end) {
+            error = true;
+        }
+        return produced;
+    }
+
+    bool failed() const {
+        return error;
+    }
+
+    // size of the (compressed) file, and how much of it has been read so far
+    uint64_t size() const {
+        return total_bytes;
+    }
+
+    uint64_t bytes_read() const {
+        return consumed_bytes.load(memory_order_relaxed);
+    }
+};
+
+// calls on_row(row) for every non blank data row the reader decompresses (the header row is skipped), the same rows
+// scan_csv_rows would find in the decompressed file. on_row returns false to stop early
+// the reader runs on its own thread, filling BLOCKS buffers of BLOCK_SIZE bytes that are handed over here and given
+// back once their rows are done -- so decompression runs ahead by at most that much, and nothing else is buffered
+// apart from a row that straddles two blocks. returns false if the input turned out to be corrupt
+bool stream_csv_rows(decompressing_reader& reader, const function<bool(string_view)>& on_row) {
+    const size_t BLOCK_SIZE = 1 << 20;
+    const int BLOCKS = 4;
+
+    vector<vector<char>> blocks(BLOCKS, vector<char>(BLOCK_SIZE));
+    vector<size_t> block_sizes(BLOCKS, 0);
+    mutex lock;
+    condition_variable changed;
+    deque<int> free_blocks;
+    // filled blocks in file order, then -1 once the reader is done
+    deque<int> full_blocks;
+    bool stopping = false;
+    for (int i = 0; i < BLOCKS; i++) {
+        free_blocks.push_back(i);
+    }
+
+    thread decompressor([&]() {
+        while (true) {
+            int block;
+            {
+                unique_lock<mutex> guard(lock);
+                changed.wait(guard, [&]() { return stopping || !free_blocks.empty(); });
+                if (stopping) return;
+                block = free_blocks.front();
+                free_blocks.pop_front();
+            }
+            // fill the block all the way, so rows are only split at the ends of megabyte blocks
+            size_t size = 0;
+            while (size < BLOCK_SIZE) {
+                size_t got = reader.read(blocks[block].data() + size, BLOCK_SIZE - size);
+                if (got == 0) break;
+                size += got;
+            }
+            block_sizes[block] = size;
+            lock_guard<mutex> guard(lock);
+            if (size > 0) {
+                full_blocks.push_back(block);
+            }
+            if (size < BLOCK_SIZE) {
+                full_blocks.push_back(-1);
+                changed.notify_all();
+                return;
+            }
+            changed.notify_all();
+        }
+    });
+
+    // the unfinished row at the end of the last block, and whether the header row has been passed yet
+    string carry;
+    bool header_done = false;
+    bool keep_going = true;
+    auto row_done = [&](string_view row) {
+        if (!header_done) {
+            header_done = true;
+            return true;
+        }
+        // skip blank lines (including a lone '\r' from windows line endings)
+        if (row.size() > 1 || (row.size() == 1 && row[0] != '\r')) {
+            return on_row(row);
+        }
+        return true;
+    };
+
+    while (keep_going) {
+        int block;
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [&]() { return !full_blocks.empty(); });
+            block = full_blocks.front();
+            full_blocks.pop_front();
+        }
+        if (block < 0) {
+            if (!carry.empty()) {
+                row_done(carry);
+            }
+            break;
+        }
+
+        const char* data = blocks[block].data();
+        size_t size = block_sizes[block];
+        size_t start = 0;
+        while (keep_going) {
+            const char* row_end = static_cast<const char*>(memchr(data + start, '\n', size - start));
+            if (row_end == nullptr) {
+                carry.append(data + start, size - start);
+                break;
+            }
+            size_t end = row_end - data;
+            if (!carry.empty()) {
+                carry.append(data + start, end - start);
+                keep_going = row_done(carry);
+                carry.clear();
+            }
+            else {
+                keep_going = row_done(string_view(data + start, end - start));
+            }
+            start = end + 1;
+        }
+
+        lock_guard<mutex> guard(lock);
+        free_blocks.push_back(block);
+        changed.notify_all();
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    decompressor.join();
+    return !reader.failed();
+}
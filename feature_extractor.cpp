@@ -0,0 +1,144 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "board_state.cpp"
+#include "position_features.cpp"
+#include "position_loader.cpp"
+#include "work_stealing_pool.cpp"
+
+using namespace std;
+
+// offline pass that works out the difficulty features of every puzzle in a csv and caches them next to it
+// (lichess_db_puzzle.csv.features), where the loader picks them up for difficulty queries. it also records which
+// rows can be played and which repeat an earlier position, so the loader's index build doesn't parse any FEN
+//
+//   feature_extractor lichess_db_puzzle.csv
+//   feature_extractor lichess_db_puzzle.csv --threads 4
+//
+// the mapped csv is cut into chunks on row starts (see chunk_starts) and every chunk is parsed with board_state and
+// scored on its own worker, one row at a time, so the only thing the workers share is the read-only mapping. the
+// chunks are written out in order once all are done
+
+int extract(const string& csv_filename, unsigned threads) {
+    uint64_t csv_size;
+    int64_t csv_mtime;
+    mapped_file csv;
+    if (!get_csv_stamp(csv_filename, csv_size, csv_mtime) || !csv.open(csv_filename)) {
+        cerr << "Error, we could not map the file: " << csv_filename << endl;
+        return 1;
+    }
+
+    auto start_time = chrono::steady_clock::now();
+    vector<size_t> starts = chunk_starts(csv.data(), csv.size());
+    size_t chunks = starts.size() - 1;
+    vector<vector<position_features>> chunk_features(chunks);
+    // position hash of every row, for finding the repeats once all chunks are done
+    vector<vector<uint64_t>> chunk_hashes(chunks);
+    {
+        work_stealing_pool pool(threads);
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            pool.submit(chunk, [&, chunk]() {
+                vector<position_features>& features = chunk_features[chunk];
+                vector<uint64_t>& hashes = chunk_hashes[chunk];
+                features.reserve((starts[chunk + 1] - starts[chunk]) / 128);
+                hashes.reserve(features.capacity());
+                scan_csv_range(csv.data(), csv.size(), starts[chunk], starts[chunk + 1], [&](uint64_t, string_view row) {
+                    // the same check the loader makes on a row, see playable_position
+                    string_view fields[CSV_COLUMNS];
+                    split_csv_row(row, fields, CSV_COLUMNS);
+                    unsigned long long position[PIECE_TYPES];
+                    bool playable = playable_position(fields, false, position);
+                    features.push_back(playable ? compute_features(position) : position_features{});
+                    hashes.push_back(playable ? zobrist_hash(position) : 0);
+                    return true;
+                });
+            });
+        }
+        pool.wait_idle();
+    }
+
+    // which position comes first is a matter of file order, so the repeats are marked in one pass over the chunks
+    seen_positions seen;
+    uint64_t repeats = 0;
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        for (size_t i = 0; i < chunk_features[chunk].size(); i++) {
+            position_features& features = chunk_features[chunk][i];
+            if (features.valid && !seen.insert(chunk_hashes[chunk][i])) {
+                features.repeat = 1;
+                repeats++;
+            }
+        }
+        vector<uint64_t>().swap(chunk_hashes[chunk]);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+    // same write-then-rename as the row index, so the loader never maps half a file
+    string features_filename = csv_filename + ".features";
+    string temp_filename = features_filename + ".tmp";
+    ofstream out(temp_filename, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        cerr << "Error, we could not create the file: " << temp_filename << endl;
+        return 1;
+    }
+    features_header header = {};
+    memcpy(header.magic, FEATURES_MAGIC, sizeof(FEATURES_MAGIC));
+    header.version = FEATURES_VERSION;
+    header.csv_size = csv_size;
+    header.csv_mtime = csv_mtime;
+    header.record_size = sizeof(position_features);
+    for (const auto& features : chunk_features) {
+        header.row_count += features.size();
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    uint64_t valid = 0;
+    uint64_t by_difficulty[11] = {};
+    for (const auto& features : chunk_features) {
+        out.write(reinterpret_cast<const char*>(features.data()), features.size() * sizeof(position_features));
+        for (const position_features& row : features) {
+            if (row.valid) {
+                valid++;
+                by_difficulty[row.difficulty / 10]++;
+            }
+        }
+    }
+    out.close();
+    if (!out) {
+        cerr << "Error, failed writing: " << temp_filename << endl;
+        return 1;
+    }
+    error_code error;
+    filesystem::rename(temp_filename, features_filename, error);
+    if (error) {
+        cerr << "Error, could not replace " << features_filename << ": " << error.message() << endl;
+        return 1;
+    }
+
+    cout << "Wrote features of " << header.row_count << " rows (" << header.row_count - valid << " bad, " << repeats
+         << " repeats) to "
+         << features_filename << " in " << seconds << " s on " << threads << " threads ("
+         << (uint64_t)(header.row_count / max(seconds, 1e-9)) << " rows/s)" << endl;
+    cout << "difficulty:";
+    for (int decile = 0; decile <= 10; decile++) {
+        if (by_difficulty[decile] > 0) {
+            cout << "  " << decile * 10 << "+ " << by_difficulty[decile];
+        }
+    }
+    cout << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    if (argc == 4 && string(argv[2]) == "--threads") {
+        threads = max((unsigned)strtoul(argv[3], nullptr, 10), 1u);
+    }
+    else if (argc != 2) {
+        cerr << "usage: " << argv[0] << " <puzzles.csv> [--threads N]" << endl;
+        return 1;
+    }
+    return extract(argv[1], threads);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include "board_state.cpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// many positions stored struct-of-arrays: boards[type][i] is the piece_type bitboard of position i
+// this keeps every bitboard of one type contiguous, which is what a bulk scan over millions of positions wants
+struct bitboard_batch {
+    vector<unsigned long long> boards[PIECE_TYPES];
+    // 0 where the FEN at that index was malformed (its bitboards are then all zero)
+    vector<uint8_t> valid;
+
+    void resize(size_t count) {
+        for (auto& board : boards) {
+            board.resize(count);
+        }
+        valid.resize(count);
+    }
+
+    size_t size() const {
+        return valid.size();
+    }
+
+    board_state get(size_t index) const {
+        unsigned long long position[PIECE_TYPES];
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            position[type] = boards[type][index];
+        }
+        board_state board;
+        board.set_bitboards(position);
+        return board;
+    }
+
+    // stores board at index (which has to be below size()) as a valid position
+    void set(size_t index, const board_state& board) {
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            boards[type][index] = board.get_bitboard((piece_type)type);
+        }
+        valid[index] = 1;
+    }
+};
+
+// length of the placement field (up to the first space) of a FEN
+// checks 16 characters per step with SSE2 -- a lichess placement field is 20-70 characters, so this is a handful
+// of compares instead of one per character, and lets the table parser run without looking for the end itself
+inline size_t fen_placement_length(string_view fen) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i spaces = _mm_set1_epi8(' ');
+    for (; i + 16 <= fen.size(); i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fen.data() + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, spaces));
+        if (mask != 0) {
+            return i + lowest_bit_index((uint64_t)mask);
+        }
+    }
+#endif
+    for (; i < fen.size(); i++) {
+        if (fen[i] == ' ') {
+            return i;
+        }
+    }
+    return fen.size();
+}
+
+// parses count FENs into the batch (which is resized to fit) and returns how many of them were valid
+size_t parse_many(const string_view* fens, size_t count, bitboard_batch& batch) {
+    batch.resize(count);
+    size_t valid_count = 0;
+    unsigned long long position[PIECE_TYPES];
+    for (size_t i = 0; i < count; i++) {
+        string_view placement = fens[i].substr(0, fen_placement_length(fens[i]));
+        bool valid = parse_fen_placement(placement, position);
+        if (!valid) {
+            memset(position, 0, sizeof(position));
+        }
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            batch.boards[type][i] = position[type];
+        }
+        batch.valid[i] = valid;
+        valid_count += valid;
+    }
+    return valid_count;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// where frame time goes: PROFILE_SCOPE("name") times the rest of the enclosing block into a ring buffer of events,
+// which write_chrome_trace dumps in the Chrome trace format (open it in chrome://tracing or ui.perfetto.dev)
+//
+// all of it is compiled out unless MEMORY_CHESS_PROFILE is defined -- PROFILE_SCOPE then expands to nothing, so the
+// normal build pays nothing at all for the instrumentation left in the code
+
+inline uint64_t profile_clock_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// small stable number for the calling thread, for the trace's tid
+inline uint32_t profile_thread_id() {
+    static atomic<uint32_t> next_id{1};
+    thread_local uint32_t id = next_id.fetch_add(1, memory_order_relaxed);
+    return id;
+}
+
+// the last CAPACITY timed scopes from any thread. writers claim a slot with one fetch_add and never wait; the slot's
+// sequence number is written last, so a reader can tell a finished event from one still being written (or one that
+// was overwritten while it read it) and skips those. older events are simply overwritten when the ring wraps
+class profile_ring {
+    private:
+
+    static const size_t CAPACITY = 1 << 16;
+
+    struct slot {
+        // index + 1 of the event in the slot, 0 while empty
+        atomic<uint64_t> sequence{0};
+        atomic<const char*> name{nullptr};
+        atomic<uint64_t> start_ns{0};
+        atomic<uint64_t> duration_ns{0};
+        atomic<uint32_t> thread{0};
+    };
+
+    slot slots[CAPACITY];
+    atomic<uint64_t> next{0};
+
+    public:
+
+    struct event {
+        const char* name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        uint32_t thread;
+    };
+
+    void record(const char* name, uint64_t start_ns, uint64_t duration_ns) {
+        uint64_t index = next.fetch_add(1, memory_order_relaxed);
+        slot& s = slots[index & (CAPACITY - 1)];
+        s.sequence.store(0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        s.name.store(name, memory_order_relaxed);
+        s.start_ns.store(start_ns, memory_order_relaxed);
+        s.duration_ns.store(duration_ns, memory_order_relaxed);
+        s.thread.store(profile_thread_id(), memory_order_relaxed);
+        s.sequence.store(index + 1, memory_order_release);
+    }
+
+    // copy of every complete event still in the ring, oldest first
+    vector<event> snapshot() const {
+        vector<event> events;
+        uint64_t end = next.load(memory_order_acquire);
+        uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+        events.reserve(end - begin);
+        for (uint64_t index = begin; index < end; index++) {
+            const slot& s = slots[index & (CAPACITY - 1)];
+            if (s.sequence.load(memory_order_acquire) != index + 1) continue;
+            event e = {s.name.load(memory_order_relaxed), s.start_ns.load(memory_order_relaxed),
+                       s.duration_ns.load(memory_order_relaxed), s.thread.load(memory_order_relaxed)};
+            atomic_thread_fence(memory_order_acquire);
+            if (s.sequence.load(memory_order_relaxed) != index + 1) continue;
+            events.push_back(e);
+        }
+        return events;
+    }
+};
+
+// writes events as Chrome trace JSON ("complete" events, times in microseconds)
+bool write_chrome_trace(const string& filename, const vector<profile_ring::event>& events) {
+    ofstream out(filename);
+    if (!out) {
+        cerr << "Error, we could not create the file: " << filename << endl;
+        return false;
+    }
+    uint64_t origin = events.empty() ? 0 : events.front().start_ns;
+    for (const auto& e : events) {
+        origin = min(origin, e.start_ns);
+    }
+    out << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < events.size(); i++) {
+        const auto& e = events[i];
+        out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+            << ",\"ts\":" << (e.start_ns - origin) / 1000.0 << ",\"dur\":" << e.duration_ns / 1000.0 << "}"
+            << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    return bool(out);
+}
+
+// the last few hundred frame times, for percentiles
+class frame_times {
+    private:
+
+    static const size_t WINDOW = 240;
+    uint64_t times_ns[WINDOW] = {};
+    size_t count = 0;
+
+    public:
+
+    void add(uint64_t duration_ns) {
+        times_ns[count % WINDOW] = duration_ns;
+        count++;
+    }
+
+    // p in [0, 1], e.g. 0.99 for p99. in milliseconds, 0 before the first frame
+    double percentile_ms(double p) const {
+        size_t n = min(count, WINDOW);
+        if (n == 0) return 0;
+        vector<uint64_t> sorted(times_ns, times_ns + n);
+        size_t rank = min(n - 1, (size_t)(p * n));
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank] / 1e6;
+    }
+};
+
+#ifdef MEMORY_CHESS_PROFILE
+
+inline profile_ring profile_events;
+
+// times from construction to the end of the scope
+class profile_scope {
+    private:
+
+    const char* name;
+    uint64_t start_ns;
+
+    public:
+
+    explicit profile_scope(const char* scope_name) : name(scope_name), start_ns(profile_clock_ns()) {}
+    ~profile_scope() {
+        profile_events.record(name, start_ns, profile_clock_ns() - start_ns);
+    }
+    profile_scope(const profile_scope&) = delete;
+    profile_scope& operator=(const profile_scope&) = delete;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) profile_scope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+
+#endif
@@ -0,0 +1,504 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "board_state.cpp"
+#include "position_loader.cpp"
+#include "position_pack.cpp"
+#include "work_stealing_pool.cpp"
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// headless grading service: clients fetch puzzles and send back their reconstruction, the server scores it
+//
+//   grading_server lichess_db_puzzle.pack             tcp on 127.0.0.1:7878
+//   grading_server lichess_db_puzzle.pack 9000        tcp on 127.0.0.1:9000
+//   grading_server lichess_db_puzzle.csv unix:/tmp/memory_chess.sock
+//
+// protocol: a stream of fixed size little endian messages in both directions. every request starts with a
+// request_header and gets exactly one reply starting with a reply_header that echoes its request_id. replies to
+// grade requests can come back out of order (they are scored on the worker threads), so match them up by id
+//
+//   MESSAGE_FETCH  request: header                      reply: header + fetch_reply
+//   MESSAGE_GRADE  request: header + grade_request      reply: header + grade_reply
+//
+// one thread owns every socket and does all the reading and writing with poll(); grading runs on a
+// work_stealing_pool, one task per batch of grade requests read from a connection at once. a pack is mapped once at
+// startup and only ever read after that, so the workers share it without any locking. a csv is read a row at a time
+// through its row index, which the threads take turns at
+
+enum message_type : uint8_t {
+    MESSAGE_FETCH = 1,
+    MESSAGE_GRADE = 2
+};
+
+enum reply_status : uint8_t {
+    STATUS_OK = 0,
+    // puzzle number out of range or not a playable position, or a board with more than 32 pieces
+    STATUS_BAD_REQUEST = 1
+};
+
+struct request_header {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t request_id;
+};
+
+struct reply_header {
+    uint8_t type;
+    uint8_t status;
+    uint8_t reserved[2];
+    uint32_t request_id;
+};
+
+// a board on the wire: the first 24 bytes of a pack_record (occupancy bits, then a piece_type nibble per piece)
+struct wire_board {
+    uint64_t occupancy;
+    uint8_t pieces[16];
+};
+
+struct fetch_reply {
+    uint32_t puzzle;
+    uint32_t reserved;
+    wire_board board;
+};
+
+struct grade_request {
+    uint32_t puzzle;
+    uint32_t reserved;
+    wire_board board;
+};
+
+struct grade_reply {
+    uint8_t solved;
+    uint8_t correct_squares;
+    uint8_t reserved[2];
+};
+
+static_assert(sizeof(request_header) == 8 && sizeof(reply_header) == 8, "header layout changed");
+static_assert(sizeof(wire_board) == 24 && sizeof(grade_request) == 32 && sizeof(fetch_reply) == 32 &&
+              sizeof(grade_reply) == 4, "message layout changed");
+
+#ifdef _WIN32
+
+int main() {
+    cerr << "Error, the grading server needs POSIX sockets" << endl;
+    return 1;
+}
+
+#else
+
+// every puzzle the server hands out: either the mapped pack file itself, or a csv read through its row index (see
+// position_loader::open_indexed), which keeps memory use the same however many puzzles the csv has. a csv row is
+// only parsed when it is fetched or graded, so a row that can't be played is only found out then
+struct puzzle_store {
+    position_loader* indexed = nullptr;
+    const pack_record* records = nullptr;
+    uint32_t count = 0;
+
+    bool open(position_loader& loader, const string& filename) {
+        bool is_pack = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".pack") == 0;
+        if (is_pack) {
+            if (!loader.open_position_pack(filename)) {
+                return false;
+            }
+            records = &loader.get_pack_record(0);
+            count = loader.get_pack_count();
+            return true;
+        }
+        if (!loader.open_indexed(filename)) {
+            return false;
+        }
+        indexed = &loader;
+        count = (uint32_t)min<uint64_t>(loader.get_indexed_count(), UINT32_MAX);
+        return true;
+    }
+
+    // false (leaving board empty) if the puzzle can't be played
+    bool get(uint32_t index, board_state& board) const {
+        board = records != nullptr ? unpack_board(records[index]) : indexed->get_indexed_board(index);
+        return board.occupancy() != 0;
+    }
+
+    bool get_wire(uint32_t index, wire_board& wire) const {
+        memset(&wire, 0, sizeof(wire));
+        if (records != nullptr) {
+            wire.occupancy = records[index].occupancy;
+            memcpy(wire.pieces, records[index].pieces, sizeof(wire.pieces));
+            return true;
+        }
+        board_state board;
+        if (!get(index, board) || popcount64(board.occupancy()) > 32) {
+            return false;
+        }
+        wire.occupancy = board.occupancy();
+        pack_pieces(board, wire.pieces);
+        return true;
+    }
+};
+
+bool unpack_wire_board(const wire_board& wire, board_state& board) {
+    // unpack_board reads one nibble per set bit, so more than 32 would run off the end of pieces
+    if (popcount64(wire.occupancy) > 32) {
+        return false;
+    }
+    pack_record record = {};
+    record.occupancy = wire.occupancy;
+    memcpy(record.pieces, wire.pieces, sizeof(record.pieces));
+    board = unpack_board(record);
+    return true;
+}
+
+// most reply bytes a connection may have waiting (written out or still being graded) before the server stops reading
+// its requests. a client that keeps sending without reading its replies then fills its own socket buffers and gets
+// held up by TCP, instead of growing the server's memory
+const size_t MAX_REPLY_BACKLOG = 1 << 20;
+
+struct connection {
+    int fd;
+    uint64_t id;
+    vector<uint8_t> input;
+    // the client shut down its side: no more requests, but the ones already read still get their replies, and the
+    // connection is closed once those are all written
+    bool input_done = false;
+    // replies waiting to be written. the workers append to it, the poll thread drains it
+    mutex output_lock;
+    vector<uint8_t> output;
+    // bytes of the replies to grading tasks still queued for this connection (guarded by output_lock)
+    size_t grading_bytes = 0;
+    // complete requests are left in input because the backlog hit the cap. they are answered once it drains
+    bool paused = false;
+
+    // replies owed to the client, written or not. only with output_lock held
+    size_t backlog() const {
+        return output.size() + grading_bytes;
+    }
+};
+
+template <typename T>
+void append_bytes(vector<uint8_t>& buffer, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+struct pending_grade {
+    uint32_t request_id;
+    grade_request request;
+};
+
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) {
+    stop_requested = 1;
+}
+
+int open_listener(const string& address) {
+    int fd;
+    if (address.rfind("unix:", 0) == 0) {
+        string path = address.substr(5);
+        sockaddr_un local = {};
+        if (path.size() >= sizeof(local.sun_path)) {
+            cerr << "Error, unix socket path too long: " << path << endl;
+            return -1;
+        }
+        local.sun_family = AF_UNIX;
+        memcpy(local.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+            cerr << "Error, we could not bind " << path << ": " << strerror(errno) << endl;
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    }
+    else {
+        sockaddr_in local = {};
+        local.sin_family = AF_INET;
+        local.sin_port = htons((uint16_t)atoi(address.c_str()));
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        }
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+            cerr << "Error, we could not bind port " << address << ": " << strerror(errno) << endl;
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 128) != 0) {
+        cerr << "Error, listen failed: " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "usage: grading_server <pack or csv> [port | unix:/path]" << endl;
+        return 1;
+    }
+    string address = argc >= 3 ? argv[2] : "7878";
+
+    position_loader loader;
+    puzzle_store store;
+    if (!store.open(loader, argv[1])) {
+        cerr << "Error, no positions to serve" << endl;
+        return 1;
+    }
+
+    int listener = open_listener(address);
+    if (listener < 0) {
+        return 1;
+    }
+
+    // the workers poke this pipe after queueing replies, so poll() wakes up to write them
+    int wake_pipe[2];
+    if (pipe(wake_pipe) != 0) {
+        cerr << "Error, pipe failed: " << strerror(errno) << endl;
+        return 1;
+    }
+    fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    work_stealing_pool pool;
+    mt19937_64 random_engine(random_device{}());
+    uniform_int_distribution<uint32_t> any_puzzle(0, store.count - 1);
+
+    // connections are shared with the grading tasks, so one that closes while its grades are in flight stays alive
+    // until they are done (they only ever touch its output buffer, never the socket)
+    unordered_map<int, shared_ptr<connection>> connections;
+    uint64_t next_connection_id = 0;
+    vector<pollfd> poll_fds;
+
+    cout << "Serving " << store.count << " positions on " << address << " with " << pool.size() << " workers" << endl;
+
+    while (!stop_requested) {
+        poll_fds.clear();
+        poll_fds.push_back({listener, POLLIN, 0});
+        poll_fds.push_back({wake_pipe[0], POLLIN, 0});
+        // a connection that was held back with requests still in its input can go on as soon as its backlog is down,
+        // without waiting for anything on the socket
+        int timeout = 500;
+        for (auto& [fd, client] : connections) {
+            lock_guard<mutex> guard(client->output_lock);
+            bool room = client->backlog() < MAX_REPLY_BACKLOG;
+            // after the client's end of file there is nothing left to read, only replies to write. with too many
+            // replies owed, nothing is read until the client has taken some of them
+            short events = !client->input_done && room ? POLLIN : 0;
+            if (!client->output.empty()) {
+                events |= POLLOUT;
+            }
+            if (room && client->paused) {
+                timeout = 0;
+            }
+            poll_fds.push_back({fd, events, 0});
+        }
+
+        if (poll(poll_fds.data(), poll_fds.size(), timeout) < 0) {
+            if (errno == EINTR) continue;
+            cerr << "Error, poll failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        if (poll_fds[1].revents & POLLIN) {
+            char drain[256];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+        }
+
+        if (poll_fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listener, nullptr, nullptr)) >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                int no_delay = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+                auto client = make_shared<connection>();
+                client->fd = fd;
+                client->id = next_connection_id++;
+                connections[fd] = client;
+            }
+        }
+
+        for (size_t i = 2; i < poll_fds.size(); i++) {
+            auto found = connections.find(poll_fds[i].fd);
+            if (found == connections.end()) continue;
+            shared_ptr<connection> client = found->second;
+            bool closed = (poll_fds[i].revents & (POLLERR | POLLNVAL)) != 0;
+            // hung up after already shutting down its side: the client is gone, nobody is left to read the replies
+            closed |= client->input_done && (poll_fds[i].revents & POLLHUP);
+
+            if (!closed && !client->input_done && (poll_fds[i].revents & (POLLIN | POLLHUP))) {
+                uint8_t buffer[64 * 1024];
+                ssize_t got = 1;
+                // at most a backlog's worth of requests at a time, the rest waits in the socket
+                while (client->input.size() < MAX_REPLY_BACKLOG &&
+                       (got = read(client->fd, buffer, sizeof(buffer))) > 0) {
+                    client->input.insert(client->input.end(), buffer, buffer + got);
+                }
+                // end of file only stops the reading -- every complete request that came before it is still answered
+                // below, and the connection is closed once the replies are written
+                if (got == 0) {
+                    client->input_done = true;
+                }
+                else if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    closed = true;
+                }
+            }
+
+            // answer fetches right here, collect the grades into one task. this also picks up requests left over from
+            // a wakeup where the backlog was full
+            size_t backlog;
+            {
+                lock_guard<mutex> guard(client->output_lock);
+                backlog = client->backlog();
+            }
+            if (!closed && backlog < MAX_REPLY_BACKLOG) {
+                const size_t grade_reply_bytes = sizeof(reply_header) + sizeof(grade_reply);
+                vector<pending_grade> grades;
+                size_t used = 0;
+                client->paused = false;
+                while (!closed && client->input.size() - used >= sizeof(request_header)) {
+                    if (backlog + grades.size() * grade_reply_bytes >= MAX_REPLY_BACKLOG) {
+                        client->paused = true;
+                        break;
+                    }
+                    request_header header;
+                    memcpy(&header, client->input.data() + used, sizeof(header));
+                    if (header.type == MESSAGE_FETCH) {
+                        used += sizeof(header);
+                        fetch_reply reply = {};
+                        // a csv can have rows that aren't playable, pick another one then
+                        bool found = false;
+                        for (int tries = 0; tries < 64 && !found; tries++) {
+                            reply.puzzle = any_puzzle(random_engine);
+                            found = store.get_wire(reply.puzzle, reply.board);
+                        }
+                        uint8_t status = found ? STATUS_OK : STATUS_BAD_REQUEST;
+                        lock_guard<mutex> guard(client->output_lock);
+                        append_bytes(client->output, reply_header{MESSAGE_FETCH, status, {}, header.request_id});
+                        append_bytes(client->output, reply);
+                        backlog += sizeof(reply_header) + sizeof(fetch_reply);
+                    }
+                    else if (header.type == MESSAGE_GRADE) {
+                        if (client->input.size() - used < sizeof(header) + sizeof(grade_request)) break;
+                        pending_grade grade;
+                        grade.request_id = header.request_id;
+                        memcpy(&grade.request, client->input.data() + used + sizeof(header), sizeof(grade.request));
+                        grades.push_back(grade);
+                        used += sizeof(header) + sizeof(grade_request);
+                    }
+                    else {
+                        // not speaking our protocol, nothing after this can be trusted to line up
+                        closed = true;
+                    }
+                }
+                client->input.erase(client->input.begin(), client->input.begin() + used);
+
+                if (!grades.empty() && !closed) {
+                    {
+                        lock_guard<mutex> guard(client->output_lock);
+                        client->grading_bytes += grades.size() * grade_reply_bytes;
+                    }
+                    pool.submit(client->id, [client, grades = move(grades), grade_reply_bytes, &store, &wake_pipe]() {
+                        vector<uint8_t> replies;
+                        replies.reserve(grades.size() * grade_reply_bytes);
+                        board_state attempt;
+                        for (const pending_grade& grade : grades) {
+                            grade_reply reply = {};
+                            uint8_t status = STATUS_BAD_REQUEST;
+                            board_state solution;
+                            if (grade.request.puzzle < store.count && unpack_wire_board(grade.request.board, attempt) &&
+                                store.get(grade.request.puzzle, solution)) {
+                                reply.solved = attempt == solution;
+                                reply.correct_squares = (uint8_t)attempt.how_many_squares_correct(solution);
+                                status = STATUS_OK;
+                            }
+                            append_bytes(replies, reply_header{MESSAGE_GRADE, status, {}, grade.request_id});
+                            append_bytes(replies, reply);
+                        }
+                        {
+                            lock_guard<mutex> guard(client->output_lock);
+                            client->output.insert(client->output.end(), replies.begin(), replies.end());
+                            client->grading_bytes -= grades.size() * grade_reply_bytes;
+                        }
+                        char poke = 0;
+                        (void)!write(wake_pipe[1], &poke, 1);
+                    });
+                }
+            }
+
+            if (closed) {
+                close(client->fd);
+                connections.erase(found);
+            }
+        }
+
+        // write whatever replies are ready, as far as each socket will take them, and close the connections whose
+        // client is done sending once the last of their replies is out
+        for (auto it = connections.begin(); it != connections.end();) {
+            shared_ptr<connection> client = it->second;
+            bool finished = false;
+            {
+                lock_guard<mutex> guard(client->output_lock);
+                if (!client->output.empty()) {
+                    ssize_t sent = write(client->fd, client->output.data(), client->output.size());
+                    if (sent > 0) {
+                        client->output.erase(client->output.begin(), client->output.begin() + sent);
+                    }
+                    // can't be written any more (the client is gone), so there is no point keeping the rest
+                    else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        finished = true;
+                    }
+                }
+                finished |= client->input_done && !client->paused && client->output.empty() && client->grading_bytes == 0;
+            }
+            if (finished) {
+                close(client->fd);
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    cout << "Shutting down" << endl;
+    pool.wait_idle();
+    for (auto& [fd, client] : connections) {
+        close(fd);
+    }
+    close(listener);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    if (address.rfind("unix:", 0) == 0) {
+        unlink(address.substr(5).c_str());
+    }
+    return 0;
+}
+
+#endif
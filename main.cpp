@@ -1,217 +1,37 @@
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <filesystem>
 #include <iostream>
 #include <SFML/Graphics.hpp>
-#include <map>
 #include <string>
+#include <thread>
+#include "board_renderer.cpp"
 #include "board_state.cpp"
+#include "fen_batch.cpp"
+#include "frame_profiler.cpp"
+#include "memory_chess_core.cpp"
 #include "position_loader.cpp"
+#include "puzzle_prefetcher.cpp"
+#include "similarity_search.cpp"
+#include "work_stealing_pool.cpp"
 
 using namespace std;
 
-// we want to display the board and then a palette on the right with all the pieces, that we can drag onto the board 
+// the SFML front end: loads the assets and positions, turns window events into game inputs for a game_session and
+// draws it. the rules are in memory_chess_core.cpp, the drawing helpers in board_renderer.cpp
 
-const int BOARD_SIZE = 800; 
-
-const int SQUARE_SIZE = BOARD_SIZE / 8; 
-
-const int PALETTE_WIDTH = 200;
-
-const int WINDOW_WIDTH = BOARD_SIZE + PALETTE_WIDTH;
-
-const int WINDOW_HEIGHT = BOARD_SIZE; 
-
-// textures used by sfml to generate graphics -- stored in memory on GPU 
-map<char, sf::Texture> pieceTextures; 
-
-// function to load all piece textures
-bool loadPieceTextures() {
-    // map of piece characters to filenames
-    map<char, string> pieceFiles = {
-        {'K', "assets/wK.png"}, {'Q', "assets/wQ.png"}, 
-        {'R', "assets/wR.png"}, {'B', "assets/wB.png"},
-        {'N', "assets/wN.png"}, {'P', "assets/wP.png"},
-        {'k', "assets/bK.png"}, {'q', "assets/bQ.png"},
-        {'r', "assets/bR.png"}, {'b', "assets/bB.png"},
-        {'n', "assets/bN.png"}, {'p', "assets/bP.png"}
-    };
-    
-    // compiler figures out type of char, string pair 
-    for (const auto& pair : pieceFiles) {
-        // loadfromfile (part of sf::Texture )loads png into texture, key and path are provided from map above
-        // checks if pair.first key exists in the map 
-        // if it doesn't, create it and set a default texture
-        // if it does, access the existing texture
-        // then call loadfromfile on that texture 
-        // so when the if conditional check passes, we fill the map pieceTextures
-        if (!pieceTextures[pair.first].loadFromFile(pair.second)) {
-            cerr << "Failed to load " << pair.second << endl;
-            return false;
-        }
-    }
-    
-    return true;
-}
-
-
-struct DraggedPiece {
-    char piece; 
-    bool is_dragging;
-    sf::Vector2f position; 
-
-    DraggedPiece() : piece(' '), is_dragging(false), position(0, 0) {}
-};
-
-// drawing the chess board and painting it black and white
-void draw_board(sf::RenderWindow& window) {
-    for (int rank = 0; rank < 8; rank++) {
-        for (int file = 0; file < 8; file++) {
-            sf::RectangleShape square(sf::Vector2f(SQUARE_SIZE, SQUARE_SIZE));
-            square.setPosition(sf::Vector2f(file * SQUARE_SIZE, rank * SQUARE_SIZE));
-            
-            if ((rank + file) % 2 == 0) {
-                square.setFillColor(sf::Color(240, 217, 181)); // light squares
-            } else {
-                square.setFillColor(sf::Color(181, 136, 99)); // dark squares 
-            }
-            
-            window.draw(square);
-        }
-    }
-}
-
-// drawing palette to the right of the board
-void drawPalette(sf::RenderWindow& window, sf::Font& font) {
-
-    // making a rectangle for the palette background and then starting it at 800, 0, top right of the chess board
-    sf::RectangleShape paletteBg(sf::Vector2f(PALETTE_WIDTH, WINDOW_HEIGHT));
-    paletteBg.setPosition(sf::Vector2f(BOARD_SIZE, 0));
-    // dark grey shade for the palette background 
-    paletteBg.setFillColor(sf::Color(60, 60, 60));
-    window.draw(paletteBg);
-    
-    
-    char pieces[] = {'K', 'Q', 'R', 'B', 'N', 'P', 'k', 'q', 'r', 'b', 'n', 'p'};
-    
-    for (int i = 0; i < 12; i++) {
-        char piece = pieces[i];
-
-        // drawing the boxes that will hold the pieces 
-        sf::RectangleShape pieceBox(sf::Vector2f(80, 60));
-        pieceBox.setPosition(sf::Vector2f(BOARD_SIZE + 10, 10 + i * 65));
-        pieceBox.setFillColor(sf::Color(100, 100, 100));
-        pieceBox.setOutlineColor(sf::Color(200, 200, 200));
-        pieceBox.setOutlineThickness(2);
-        window.draw(pieceBox);
-
-    }
-    
-
-    sf::Text instructions(font);
-    instructions.setCharacterSize(14);
-    instructions.setFillColor(sf::Color::White);
-    // instructions to appear below the pieces on the bottom 
-    instructions.setPosition(sf::Vector2f(BOARD_SIZE + 100, WINDOW_HEIGHT - 80));
-    instructions.setString("Drag pieces\nonto board\n\nSpace: Check\nC: Clear\nN: New");
-    window.draw(instructions);
-}
-
-// draw pieces on the board
-void drawPieces(sf::RenderWindow& window, const board_state& board) {
-    for (int square = 0; square < 64; square++) {
-        char piece = board.get_piece_at(square);
-        
-        if (piece == ' ') continue;
-        
-        int file = square % 8;
-        int rank = square / 8;
-        
-        // create sprite from texture
-        sf::Sprite pieceSprite(pieceTextures[piece]);
-        
-        // scale the sprite to fit the square
-        sf::Vector2u textureSize = pieceTextures[piece].getSize();
-        float scaleX = (float)SQUARE_SIZE / textureSize.x;
-        float scaleY = (float)SQUARE_SIZE / textureSize.y;
-        pieceSprite.setScale(sf::Vector2f(scaleX, scaleY));
-        
-        // position the sprite
-        pieceSprite.setPosition(sf::Vector2f(file * SQUARE_SIZE, rank * SQUARE_SIZE));
-        
-        window.draw(pieceSprite);
-    }
-}
-
-// check if mouse is in palette and return piece if clicked
-char getPieceFromPalette(int mouseX, int mouseY) {
-    if (mouseX < BOARD_SIZE || mouseX > BOARD_SIZE + PALETTE_WIDTH) return ' ';
-    
-    char pieces[] = {'K', 'Q', 'R', 'B', 'N', 'P', 'k', 'q', 'r', 'b', 'n', 'p'};
-    
-    for (int i = 0; i < 12; i++) {
-        int boxX = BOARD_SIZE + 10;
-        int boxY = 10 + i * 65;
-        
-        // each box we drew is 80x60 so we are checking if our mouse is within this range
-        if (mouseX >= boxX && mouseX <= boxX + 80 &&
-            mouseY >= boxY && mouseY <= boxY + 60) {
-            return pieces[i];
-        }
-    }
-    
-    return ' ';
-}
-
-// convert mouse coordinates to square index
-int getSquareFromMouse(int mouseX, int mouseY) {
-    // once we are sure we are in the board then only run the calculations of figuring out what square we are in
-    if (mouseX < 0 || mouseX >= BOARD_SIZE || mouseY < 0 || mouseY >= BOARD_SIZE) return -1;
-    
-    int file = mouseX / SQUARE_SIZE;
-    int rank = mouseY / SQUARE_SIZE;
-    return rank * 8 + file;
-}
-
-// draw the piece being dragged
-void drawDraggedPiece(sf::RenderWindow& window, const DraggedPiece& dragged) {
-    if (!dragged.is_dragging) return;
-    
-    sf::Sprite pieceSprite(pieceTextures[dragged.piece]);
-    
-    sf::Vector2u textureSize = pieceTextures[dragged.piece].getSize();
-    float scaleX = (float)SQUARE_SIZE / textureSize.x;
-    float scaleY = (float)SQUARE_SIZE / textureSize.y;
-    pieceSprite.setScale(sf::Vector2f(scaleX, scaleY));
-    
-    // center the piece on the cursor
-    pieceSprite.setPosition(sf::Vector2f(dragged.position.x - SQUARE_SIZE/2, 
-                           dragged.position.y - SQUARE_SIZE/2));
-    
-    window.draw(pieceSprite);
-}
-
-// draw piece images inside the palette boxes
-void drawPalettePieces(sf::RenderWindow& window) {
-    char pieces[] = {'K', 'Q', 'R', 'B', 'N', 'P', 'k', 'q', 'r', 'b', 'n', 'p'};
+// memory_chess                    memorize each puzzle's position
+// memory_chess --after-solution   memorize the position once the puzzle's solution has been played out
+int main(int argc, char* argv[]) {
+    bool afterSolution = argc > 1 && string(argv[1]) == "--after-solution";
     
-    for (int i = 0; i < 12; i++) {
-        sf::Sprite pieceSprite(pieceTextures[pieces[i]]);
-        
-        // scale to fit in the box (50 pixels for 80x60 box)
-        sf::Vector2u textureSize = pieceTextures[pieces[i]].getSize();
-        float scale = 50.0f / textureSize.x;
-        pieceSprite.setScale(sf::Vector2f(scale, scale));
-        
-        // center in the box
-        // offset is (15, 10) within the boxes that we drew earlier 
-        pieceSprite.setPosition(sf::Vector2f(BOARD_SIZE + 25, 20 + i * 65));
-        
-        window.draw(pieceSprite);
-    }
-}
-
-int main() {
-    // Create window
-    sf::RenderWindow window(sf::VideoMode(sf::Vector2u(WINDOW_WIDTH, WINDOW_HEIGHT)), "Memory Chess");
+    // Create window -- resizable, everything is laid out in WINDOW_WIDTH x WINDOW_HEIGHT units and scaled to fit it
+    sf::RenderWindow window(sf::VideoMode(initialWindowSize()), "Memory Chess");
+    window.setMinimumSize(sf::Vector2u(WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2));
     window.setFramerateLimit(60);
+    setWindowSize(window.getSize());
+    window.setView(screenLayout.view);
     
     // Load font
     sf::Font font;
@@ -227,314 +47,562 @@ int main() {
         return 1;
     }
     
-    // Load positions
+    // Load positions -- a converted position pack opens instantly, otherwise fall back to reading the csv through its
+    // row index (lichess_db_puzzle.csv.idx, built on the first run and whenever the csv changes), which costs the same
+    // few bytes of memory however big the csv is, or to streaming the compressed download as lichess publishes it
+    // (.zst) when there is no csv, on a background thread so the menu shows up right away
+    // a pack only has the puzzles' starting positions, so the after solution mode always reads the csv
     position_loader loader;
-    vector<string> positions = loader.load_position("lichess_db_puzzle.csv");
-    
-    if (positions.empty()) {
+    loader.set_after_solution(afterSolution);
+    if (!afterSolution && loader.open_position_pack("lichess_db_puzzle.pack")) {
+        cout << "Opened position pack with " << loader.get_pack_count() << " positions." << endl;
+    }
+    else if (filesystem::exists("lichess_db_puzzle.csv") && loader.open_indexed("lichess_db_puzzle.csv")) {
+        cout << "Reading " << loader.get_indexed_count() << " positions through the row index." << endl;
+    }
+    else if ((filesystem::exists("lichess_db_puzzle.csv.zst") && loader.start_compressed_load("lichess_db_puzzle.csv.zst")) ||
+             (filesystem::exists("lichess_db_puzzle.csv.gz") && loader.start_compressed_load("lichess_db_puzzle.csv.gz"))) {
+        cout << "Decompressing positions in the background..." << endl;
+    }
+    else {
         cerr << "No positions loaded. Exiting." << endl;
         return 1;
     }
     
-    // Initialize random seed
-    srand(time(0));
+    // Text -- every label is made once here, the ones that change are only re-laid out when their string does
+    sf::Text paletteInstructions(font);
+    paletteInstructions.setCharacterSize(14);
+    paletteInstructions.setFillColor(sf::Color::White);
+    // instructions to appear below the pieces on the bottom 
+    paletteInstructions.setPosition(sf::Vector2f(BOARD_SIZE + 100, WINDOW_HEIGHT - 80));
+    paletteInstructions.setString("Drag pieces\nonto board\n\nSpace: Check\nC: Clear\nN: New");
+    
+    TextLabel title(font, 60, sf::Color(255, 215, 0), sf::Vector2f(BOARD_SIZE / 2.0f, 100), 3);
+    title.setString("MEMORY CHESS");
+    
+    TextLabel menuInstructions(font, 20, sf::Color::White, sf::Vector2f(BOARD_SIZE / 2.0f, 400));  // prev: y --> 340
+    menuInstructions.setString(
+        "HOW TO PLAY:\n\n"
+        "1. Memorize the chess position shown\n"
+        "2. Recreate it from memory by dragging pieces\n"
+        "3. Check your accuracy!\n\n\n"
+        "CONTROLS:\n\n"
+        "Left Click - Drag pieces from palette to board\n"
+        "Right Click - Clear a square\n"
+        "SPACE - Check your solution / Start puzzle\n"
+        "S - Show solution again (5 seconds)\n"
+        "C - Clear the board\n"
+        "N - New puzzle\n"
+        "D - Drill a similar position after a miss\n"
+        "G - Memorize 1, 4, 9 or 16 boards at once\n\n\n"
+    );
+    
+    TextLabel boardCountLabel(font, 20, sf::Color(255, 215, 0), sf::Vector2f(BOARD_SIZE / 2.0f, 640));
+    boardCountLabel.setString("Boards: 1");
+    
+    TextLabel startPrompt(font, 32, sf::Color(100, 255, 100), sf::Vector2f(BOARD_SIZE / 2.0f, 680), 2);
+    startPrompt.setString("Press SPACE to Start!");
     
-    // Game states
-    enum GameState { MENU, MEMORIZING, PLAYING };
-    GameState gameState = MENU;
+    TextLabel loadStatus(font, 18, sf::Color(200, 200, 200), sf::Vector2f(BOARD_SIZE / 2.0f, 740));
     
-    // Get a random position
-    string randomFEN = loader.get_random_position(positions);
-    cout << "Loaded position: " << randomFEN << endl;
+    TextLabel memoryMessage(font, 28, sf::Color::White, sf::Vector2f(BOARD_SIZE / 2.0f, 40), 2);
+    memoryMessage.setString("Memorize this position!");
+    
+    TextLabel countdownLabel(font, 72, sf::Color(255, 100, 100), sf::Vector2f(BOARD_SIZE / 2.0f, BOARD_SIZE / 2.0f), 3);
+    
+    TextLabel playInstructions(font, 18, sf::Color(200, 200, 200), sf::Vector2f(BOARD_SIZE / 2.0f, 25));
+    playInstructions.setString("Recreate the position from memory - Press SPACE to check");
+    
+    TextLabel feedback(font, 36, sf::Color(100, 255, 100), sf::Vector2f(BOARD_SIZE / 2.0f, BOARD_SIZE - 60), 3);
+    
+    // Semi-transparent overlay over the board in the menu
+    sf::RectangleShape overlay(sf::Vector2f(BOARD_SIZE, BOARD_SIZE));
+    overlay.setPosition(sf::Vector2f(0, 0));
+    overlay.setFillColor(sf::Color(0, 0, 0, 200));
+    
+    // The game itself -- phases, timers, dragging and scoring all live in the session, this loop only turns SFML events
+    // into game inputs and draws whatever state the session is in
+    //
+    // The next puzzle is always picked and parsed ahead of time on the prefetcher's thread (the only thread that asks
+    // the loader for boards), and drawn into nextFrame here as soon as it's ready -- drawing has to stay on this
+    // thread, which owns the GL context. Starting it (N, or Space in the menu) then only swaps the two frames, and
+    // showing it again (S) reuses currentFrame as is
+    puzzle_prefetcher prefetcher([&loader](board_state& puzzle) {
+        if (loader.get_available_count() == 0) return false;
+        puzzle = loader.get_random_board();
+        return true;
+    });
+    uint64_t takenGeneration = 0;
+    game_session session([&prefetcher, &takenGeneration](board_state& puzzle) {
+        return prefetcher.take(puzzle, &takenGeneration);
+    });
+    
+    // batch indexes of the positions left to drill, closest first
+    deque<uint32_t> similarPositions;
+    
+    // Positions that look like the one just got wrong, to drill on (D after a failed check). Their bitboards go into one
+    // struct-of-arrays batch, and a query scans all of them on the pool. At about 100 bytes a position the batch is
+    // only a sample spread evenly over the whole set, at most MAX_SIMILARITY_POSITIONS of them (about 25 MB), and it is
+    // only built, on a background thread, the first time a single board check fails. The grid mode has no drills, so
+    // the batch is thrown away when it is picked, and built again after the next miss on a single board
+    const uint64_t MAX_SIMILARITY_POSITIONS = 250000;
+    bitboard_batch similarityBatch;
+    atomic<bool> similarityReady{false};
+    atomic<bool> stopSimilarityBuild{false};
+    work_stealing_pool similarityPool;
+    thread similarityBuilder;
+    // the miss that started the build, looked up once the batch is ready
+    bool similarityPending = false;
+    board_state similarityPendingSolution;
+    auto buildSimilarityBatch = [&]() {
+        // a compressed download only has its positions once it's all in
+        while (loader.is_loading() && !stopSimilarityBuild.load()) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        uint64_t total = loader.get_available_count();
+        uint64_t count = min(total, MAX_SIMILARITY_POSITIONS);
+        similarityBatch.resize(count);
+        for (uint64_t i = 0; i < count && !stopSimilarityBuild.load(); i++) {
+            uint64_t index = i * total / count;
+            board_state board;
+            if (loader.get_pack_count() > 0) {
+                board = loader.get_pack_position((uint32_t)index);
+            } else if (loader.get_compressed_count() > 0) {
+                board = loader.get_compressed_position((uint32_t)index);
+            } else {
+                board = loader.get_indexed_board(index);
+            }
+            // a csv row that can't be played stays an invalid entry, which a query skips
+            if (board.occupancy() != 0) {
+                similarityBatch.set(i, board);
+            }
+        }
+        similarityReady.store(!stopSimilarityBuild.load(), memory_order_release);
+    };
+    auto freeSimilarityBatch = [&]() {
+        if (similarityBuilder.joinable()) {
+            stopSimilarityBuild.store(true);
+            similarityBuilder.join();
+            stopSimilarityBuild.store(false);
+        }
+        similarityReady.store(false);
+        similarityBatch = bitboard_batch();
+        similarityPending = false;
+        similarPositions.clear();
+    };
+    auto findSimilarPositions = [&](const board_state& solution) {
+        similarPositions.clear();
+        for (const auto& similar : find_similar(similarityBatch, solution, 5, &similarityPool)) {
+            similarPositions.push_back(similar.index);
+        }
+        if (!similarPositions.empty()) {
+            cout << "Press D to drill a similar position." << endl;
+        }
+    };
     
-    // Create board states
-    board_state solutionBoard;
-    board_state userBoard;
+    auto currentFrame = make_unique<sf::RenderTexture>();
+    auto nextFrame = make_unique<sf::RenderTexture>();
+    bool puzzleFramesAvailable = resizePuzzleFrame(*currentFrame) && resizePuzzleFrame(*nextFrame);
+    // which puzzle each frame shows, 0 for nothing
+    uint64_t currentFrameGeneration = 0;
+    uint64_t nextFrameGeneration = 0;
+    board_state prefetchedBoard;
+    uint64_t prefetchedGeneration = 0;
     
-    solutionBoard.populate_from_FEN(randomFEN);
+    // where the piece in hand is drawn -- only the front end cares about pixels
+    sf::Vector2f dragPosition(0, 0);
+    // result frames around the boards of a grid after a check
+    sf::VertexArray boardOutlines(sf::PrimitiveType::Triangles);
     
-    // Timer for showing solution
-    sf::Clock timer;
-    float displayTime = 5.0f;
+    // Redraw state -- the window is only repainted when something on it changed, so an idle game costs next to nothing.
+    // shownCountdown / shownBlink are what the last frame showed of the two things that change on their own
+    bool needsRedraw = true;
+    int shownCountdown = 0;
+    int shownBlink = 0;
     
-    // Dragging state
-    DraggedPiece dragged;
+#ifdef MEMORY_CHESS_PROFILE
+    // Profiling build only: F3 toggles a frame time overlay, F4 writes the recorded scopes to memory_chess_trace.json
+    frame_times frameTimes;
+    bool showProfileOverlay = false;
+    sf::Text profileOverlay(font, "", 14);
+    profileOverlay.setFillColor(sf::Color(255, 255, 0));
+    profileOverlay.setPosition(sf::Vector2f(5, WINDOW_HEIGHT - 20));
+#endif
     
-    // Feedback state
-    string feedbackMessage = "";
-    sf::Clock feedbackTimer;
-    float feedbackDisplayTime = 3.0f;
-    bool showingFeedback = false;
+    // Text is rasterized at the window's resolution, so every label is set up again when the window is resized
+    TextLabel* labels[] = {&title, &menuInstructions, &boardCountLabel, &startPrompt, &loadStatus, &memoryMessage,
+                           &countdownLabel, &playInstructions, &feedback};
+    auto scaleText = [&]() {
+        for (TextLabel* label : labels) {
+            label->setPixelScale(screenLayout.scale);
+        }
+        setTextPixelScale(paletteInstructions, 14, screenLayout.scale);
+#ifdef MEMORY_CHESS_PROFILE
+        setTextPixelScale(profileOverlay, 14, screenLayout.scale);
+#endif
+    };
+    scaleText();
     
     cout << "Welcome to Memory Chess!" << endl;
     
     // Game loop
     while (window.isOpen()) {
-        // Event handling
-        while (auto event = window.pollEvent()) {
+        // Sleep until an event arrives or the next timed change is due: a countdown digit, a blink of the start
+        // prompt, the feedback message running out, or load progress. Time::Zero means no timeout at all
+        sf::Time wakeUp = sf::Time::Zero;
+        float secondsToChange = -1.0f;
+        auto dueIn = [&](float seconds) {
+            // never zero, which would mean "wait forever" to waitEvent
+            seconds = max(seconds, 0.001f);
+            secondsToChange = secondsToChange < 0 ? seconds : min(secondsToChange, seconds);
+        };
+        if (session.seconds_until_next_change() >= 0) {
+            dueIn(session.seconds_until_next_change());
+        }
+        if (session.get_phase() == PHASE_MENU && loader.get_available_count() > 0) {
+            dueIn(0.5f - fmod(session.seconds_in_phase(), 0.5f));
+        }
+        if (loader.is_loading()) {
+            dueIn(0.25f);
+        }
+        if (similarityPending) {
+            // the similar positions of the last miss, as soon as their batch is built
+            dueIn(0.1f);
+        }
+        if (puzzleFramesAvailable && boardGrid.count == 1 && nextFrameGeneration == 0 &&
+            loader.get_available_count() > 0) {
+            // the prefetcher is about to have the next puzzle, come back to draw it before it's needed
+            // (only single boards are pre-rendered, a grid would never fill nextFrame and this would never stop)
+            dueIn(0.02f);
+        }
+        if (secondsToChange > 0) {
+            wakeUp = sf::seconds(secondsToChange);
+        }
+        
+        // Event handling -- the first event (if any) from waitEvent, then whatever else is already queued
+        auto event = window.waitEvent(wakeUp);
+#ifdef MEMORY_CHESS_PROFILE
+        // a frame starts once we wake up, the time spent asleep isn't frame time
+        uint64_t frameStart = profile_clock_ns();
+#endif
+        for (; event; event = window.pollEvent()) {
+            PROFILE_SCOPE("event");
+            
+            // anything except moving the mouse around without a piece in hand can change the picture
+            if (!event->is<sf::Event::MouseMoved>() || session.get_piece_in_hand() != ' ') {
+                needsRedraw = true;
+            }
+            
             if (event->is<sf::Event::Closed>()) {
                 window.close();
             }
             
-            // Menu state - waiting for start
-            if (gameState == MENU) {
-                if (const auto* keyPress = event->getIf<sf::Event::KeyPressed>()) {
-                    if (keyPress->code == sf::Keyboard::Key::Space) {
-                        gameState = MEMORIZING;
-                        timer.restart();
-                        cout << "Starting new puzzle! Memorize the position..." << endl;
-                    }
-                }
+            // The layout is worked out once here: the scale and view, the piece atlas at the new square size, the text,
+            // and the pre-rendered puzzles at the new resolution (drawn again below)
+            if (const auto* resized = event->getIf<sf::Event::Resized>()) {
+                setWindowSize(resized->size);
+                window.setView(screenLayout.view);
+                scaleText();
+                puzzleFramesAvailable = resizePuzzleFrame(*currentFrame) && resizePuzzleFrame(*nextFrame);
+                currentFrameGeneration = 0;
+                nextFrameGeneration = 0;
             }
             
-            // Only allow interaction during PLAYING state
-            else if (gameState == PLAYING) {
-                // Mouse button pressed - start dragging
-                if (const auto* mousePress = event->getIf<sf::Event::MouseButtonPressed>()) {
-                    if (mousePress->button == sf::Mouse::Button::Left) {
-                        char piece = getPieceFromPalette(mousePress->position.x, mousePress->position.y);
-                        if (piece != ' ') {
-                            dragged.piece = piece;
-                            dragged.is_dragging = true;
-                            dragged.position = sf::Vector2f(mousePress->position.x, mousePress->position.y);
-                            cout << "Started dragging: " << piece << endl;
-                        }
-                    } else if (mousePress->button == sf::Mouse::Button::Right) {
-                        // Right click to clear square
-                        int square = getSquareFromMouse(mousePress->position.x, mousePress->position.y);
-                        if (square >= 0 && square < 64) {
-                            userBoard.set_piece_at_square(square, ' ');
-                            cout << "Cleared square " << square << endl;
-                        }
+            // Mouse button pressed - left picks a piece up from the palette, right clears a square
+            if (const auto* mousePress = event->getIf<sf::Event::MouseButtonPressed>()) {
+                if (mousePress->button == sf::Mouse::Button::Left) {
+                    char piece = getPieceFromPalette(mousePress->position);
+                    if (session.handle({INPUT_PICK_PIECE, piece})) {
+                        dragPosition = screenLayout.toLayout(mousePress->position);
+                        cout << "Started dragging: " << piece << endl;
                     }
-                }
-                
-                // Mouse moved - update drag position
-                if (const auto* mouseMove = event->getIf<sf::Event::MouseMoved>()) {
-                    if (dragged.is_dragging) {
-                        dragged.position = sf::Vector2f(mouseMove->position.x, mouseMove->position.y);
+                } else if (mousePress->button == sf::Mouse::Button::Right) {
+                    int board = 0;
+                    int square = getSquareFromMouse(mousePress->position, &board);
+                    if (session.handle({INPUT_CLEAR_SQUARE, ' ', square, board})) {
+                        cout << "Cleared square " << square << " of board " << board << endl;
                     }
                 }
-                
-                // Mouse button released - place piece
-                if (const auto* mouseRelease = event->getIf<sf::Event::MouseButtonReleased>()) {
-                    if (mouseRelease->button == sf::Mouse::Button::Left && dragged.is_dragging) {
-                        int square = getSquareFromMouse(mouseRelease->position.x, mouseRelease->position.y);
-                        if (square >= 0 && square < 64) {
-                            userBoard.set_piece_at_square(square, dragged.piece);
-                            cout << "Placed " << dragged.piece << " at square " << square << endl;
-                        }
-                        dragged.is_dragging = false;
+            }
+            
+            // Mouse moved - update drag position
+            if (const auto* mouseMove = event->getIf<sf::Event::MouseMoved>()) {
+                dragPosition = screenLayout.toLayout(mouseMove->position);
+            }
+            
+            // Mouse button released - place piece
+            if (const auto* mouseRelease = event->getIf<sf::Event::MouseButtonReleased>()) {
+                if (mouseRelease->button == sf::Mouse::Button::Left) {
+                    char piece = session.get_piece_in_hand();
+                    int board = 0;
+                    int square = getSquareFromMouse(mouseRelease->position, &board);
+                    if (session.handle({INPUT_DROP_PIECE, ' ', square, board}) && square >= 0) {
+                        cout << "Placed " << piece << " at square " << square << " of board " << board << endl;
                     }
                 }
-                
-                // Keyboard input
-                if (const auto* keyPress = event->getIf<sf::Event::KeyPressed>()) {
-                    switch (keyPress->code) {
-                        case sf::Keyboard::Key::Space:
-                            if (userBoard == solutionBoard) {
-                                feedbackMessage = "CORRECT! Perfect match!";
+            }
+            
+            // Keyboard input
+            if (const auto* keyPress = event->getIf<sf::Event::KeyPressed>()) {
+                switch (keyPress->code) {
+                    case sf::Keyboard::Key::Space:
+                        if (session.get_phase() == PHASE_MENU) {
+                            if (session.handle({INPUT_START})) {
+                                cout << "Starting new puzzle! Memorize the position..." << endl;
+                            }
+                        } else if (session.handle({INPUT_CHECK})) {
+                            if (session.was_last_check_solved()) {
                                 cout << "\n✓ CORRECT! You solved it perfectly!" << endl;
                             } else {
-                                uint32_t correct = userBoard.how_many_squares_correct(solutionBoard);
-                                feedbackMessage = "Not quite! " + to_string(correct) + "/64 squares correct";
-                                cout << "\nNot quite! " << correct << "/64 squares correct." << endl;
+                                cout << "\nNot quite! " << session.get_last_correct_count() << "/"
+                                     << 64 * session.get_board_count() << " squares correct." << endl;
+                                // drilling swaps in a single position, so only for single board puzzles
+                                if (session.get_board_count() == 1 && similarityReady.load(memory_order_acquire)) {
+                                    findSimilarPositions(session.get_solution());
+                                } else if (session.get_board_count() == 1) {
+                                    similarPositions.clear();
+                                    similarityPending = true;
+                                    similarityPendingSolution = session.get_solution();
+                                    if (!similarityBuilder.joinable()) {
+                                        cout << "Looking for similar positions..." << endl;
+                                        similarityBuilder = thread(buildSimilarityBatch);
+                                    }
+                                }
                             }
-                            showingFeedback = true;
-                            feedbackTimer.restart();
-                            break;
-                            
-                        case sf::Keyboard::Key::S:
-                            gameState = MEMORIZING;
-                            timer.restart();
+                        }
+                        break;
+                        
+                    case sf::Keyboard::Key::S:
+                        if (session.handle({INPUT_SHOW_SOLUTION})) {
                             cout << "Showing solution again..." << endl;
-                            break;
-                            
-                        case sf::Keyboard::Key::C:
-                            userBoard = board_state();
+                        }
+                        break;
+                        
+                    case sf::Keyboard::Key::C:
+                        if (session.handle({INPUT_CLEAR_BOARD})) {
                             cout << "Board cleared." << endl;
-                            break;
-                            
-                        case sf::Keyboard::Key::N:
-                            randomFEN = loader.get_random_position(positions);
-                            solutionBoard.populate_from_FEN(randomFEN);
-                            userBoard = board_state();
-                            gameState = MEMORIZING;
-                            timer.restart();
-                            showingFeedback = false;
+                        }
+                        break;
+                        
+                    case sf::Keyboard::Key::G:
+                        // 1 -> 4 -> 9 -> 16 -> 1 boards, chosen in the menu for every puzzle after it
+                        if (session.get_phase() == PHASE_MENU) {
+                            int columns = boardGrid.columns % 4 + 1;
+                            session.set_board_count(columns * columns);
+                            setBoardCount(columns * columns);
+                            boardCountLabel.setString("Boards: " + to_string(columns * columns));
+                            if (columns > 1) {
+                                freeSimilarityBatch();
+                            }
+                            cout << "Memorizing " << columns * columns << " boards at once." << endl;
+                        }
+                        break;
+                        
+                    case sf::Keyboard::Key::N:
+                        if (session.handle({INPUT_NEW_PUZZLE})) {
                             cout << "\nNew position loaded!" << endl;
-                            break;
-                            
-                        default:
-                            break;
-                    }
+                        }
+                        break;
+                        
+                    case sf::Keyboard::Key::D:
+                        if (!similarPositions.empty() &&
+                            session.play_puzzle(similarityBatch.get(similarPositions.front()))) {
+                            similarPositions.pop_front();
+                            // not one of the prefetcher's puzzles, so there is no frame of it yet -- drawn below
+                            currentFrameGeneration = 0;
+                            cout << "\nSimilar position loaded! Memorize the position..." << endl;
+                        }
+                        break;
+                        
+#ifdef MEMORY_CHESS_PROFILE
+                    case sf::Keyboard::Key::F3:
+                        showProfileOverlay = !showProfileOverlay;
+                        break;
+                        
+                    case sf::Keyboard::Key::F4:
+                        if (write_chrome_trace("memory_chess_trace.json", profile_events.snapshot())) {
+                            cout << "Wrote memory_chess_trace.json" << endl;
+                        }
+                        break;
+#endif
+                        
+                    default:
+                        break;
                 }
             }
         }
         
-        // Check if we should transition from MEMORIZING to PLAYING
-        if (gameState == MEMORIZING && timer.getElapsedTime().asSeconds() >= displayTime) {
-            gameState = PLAYING;
-            cout << "\nSolution hidden! Recreate the position from memory." << endl;
+        // The background load can finish without finding a single playable row
+        if (!loader.is_loading() && loader.get_available_count() == 0) {
+            cerr << "No positions loaded. Exiting." << endl;
+            window.close();
+            break;
+        }
+        
+        // A puzzle just started -- swap in its pre-rendered frame if it's the one we drew, otherwise draw it now
+        // (frames are of a single board, a grid is drawn from the batch every time)
+        if (puzzleFramesAvailable && session.get_board_count() == 1 && takenGeneration != 0 &&
+            takenGeneration != currentFrameGeneration) {
+            if (takenGeneration == nextFrameGeneration) {
+                swap(currentFrame, nextFrame);
+                nextFrameGeneration = 0;
+            } else {
+                renderPuzzleFrame(*currentFrame, session.get_solution());
+            }
+            currentFrameGeneration = takenGeneration;
+        }
+        
+        // Draw the waiting puzzle ahead of time, while nothing else is going on
+        if (puzzleFramesAvailable && boardGrid.count == 1 && prefetcher.peek(prefetchedBoard, prefetchedGeneration) &&
+            prefetchedGeneration != nextFrameGeneration) {
+            renderPuzzleFrame(*nextFrame, prefetchedBoard);
+            nextFrameGeneration = prefetchedGeneration;
         }
         
-        // Check if we should hide feedback
-        if (showingFeedback && feedbackTimer.getElapsedTime().asSeconds() >= feedbackDisplayTime) {
-            showingFeedback = false;
+        // The similar positions of a miss that came in while their batch was still being built
+        if (similarityPending && similarityReady.load(memory_order_acquire)) {
+            similarityPending = false;
+            findSimilarPositions(similarityPendingSolution);
         }
         
+        // Let the timers move the game on -- hiding the solution, or the feedback running out
+        game_phase phaseBefore = session.get_phase();
+        if (session.update()) {
+            needsRedraw = true;
+            if (phaseBefore == PHASE_MEMORIZING && session.get_phase() == PHASE_PLAYING) {
+                cout << "\nSolution hidden! Recreate the position from memory." << endl;
+            }
+        }
+        
+        // Timed changes: the countdown digit ticking over, the start prompt blinking, and the load status
+        int countdown = session.get_phase() == PHASE_MEMORIZING ? session.memorize_seconds_left() : 0;
+        int blink = session.get_phase() == PHASE_MENU ? ((int)(session.seconds_in_phase() * 2)) % 2 : 0;
+        if (countdown != shownCountdown || blink != shownBlink || loader.is_loading()) {
+            needsRedraw = true;
+            shownCountdown = countdown;
+            shownBlink = blink;
+        }
+        
+        // Nothing changed since the last frame, so what's on screen is still right
+        // when something did change the whole window is repainted -- after display() the back buffer's contents are
+        // undefined, so redrawing only the changed region would leave garbage everywhere else
+        if (!needsRedraw) {
+            continue;
+        }
+        needsRedraw = false;
+        
         // Rendering
         window.clear(sf::Color(40, 40, 40));
         
         draw_board(window);
-        drawPalette(window, font);
-        drawPalettePieces(window);
+        drawPalette(window, paletteInstructions);
+        
+        // palette pieces always show, the board pieces depending on the state below
+        pieceBatch.clear();
+        appendPalettePieces(pieceBatch);
         
         // MENU STATE - Show welcome screen with instructions
-        if (gameState == MENU) {
-            // Semi-transparent overlay
-            sf::RectangleShape overlay(sf::Vector2f(BOARD_SIZE, BOARD_SIZE));
-            overlay.setPosition(sf::Vector2f(0, 0));
-            overlay.setFillColor(sf::Color(0, 0, 0, 200));
+        if (session.get_phase() == PHASE_MENU) {
             window.draw(overlay);
             
-            // Title
-            sf::Text title(font);
-            title.setCharacterSize(60);
-            title.setFillColor(sf::Color(255, 215, 0));
-            title.setOutlineColor(sf::Color::Black);
-            title.setOutlineThickness(3);
-            title.setString("MEMORY CHESS");
-            
-            sf::FloatRect titleBounds = title.getLocalBounds();
-            title.setOrigin(sf::Vector2f(titleBounds.position.x + titleBounds.size.x / 2.0f,
-                           titleBounds.position.y + titleBounds.size.y / 2.0f));
-            title.setPosition(sf::Vector2f(BOARD_SIZE / 2.0f, 100));
-            window.draw(title);
-            
-            // Instructions
-            sf::Text instructions(font);
-            instructions.setCharacterSize(20);
-            instructions.setFillColor(sf::Color::White);
-            instructions.setString(
-                "HOW TO PLAY:\n\n"
-                "1. Memorize the chess position shown\n"
-                "2. Recreate it from memory by dragging pieces\n"
-                "3. Check your accuracy!\n\n\n"
-                "CONTROLS:\n\n"
-                "Left Click - Drag pieces from palette to board\n"
-                "Right Click - Clear a square\n"
-                "SPACE - Check your solution / Start puzzle\n"
-                "S - Show solution again (5 seconds)\n"
-                "C - Clear the board\n"
-                "N - New puzzle\n\n\n"
-            );
+            drawPieceBatch(window, pieceBatch);
             
-            sf::FloatRect instBounds = instructions.getLocalBounds();
-            instructions.setOrigin(sf::Vector2f(instBounds.position.x + instBounds.size.x / 2.0f,
-                                  instBounds.position.y + instBounds.size.y / 2.0f));
-            instructions.setPosition(sf::Vector2f(BOARD_SIZE / 2.0f, 400));  // prev: y --> 340
-            window.draw(instructions);
+            title.draw(window);
+            menuInstructions.draw(window);
+            boardCountLabel.draw(window);
             
-            // Start button prompt
-            sf::Text startPrompt(font);
-            startPrompt.setCharacterSize(32);
-            startPrompt.setFillColor(sf::Color(100, 255, 100));
-            startPrompt.setOutlineColor(sf::Color::Black);
-            startPrompt.setOutlineThickness(2);
-            startPrompt.setString("Press SPACE to Start!");
-            
-            sf::FloatRect promptBounds = startPrompt.getLocalBounds();
-            startPrompt.setOrigin(sf::Vector2f(promptBounds.position.x + promptBounds.size.x / 2.0f,
-                                 promptBounds.position.y + promptBounds.size.y / 2.0f));
-            startPrompt.setPosition(sf::Vector2f(BOARD_SIZE / 2.0f, 680));
+            // Blinking effect -- only once there is at least one position to play
+            if (loader.get_available_count() > 0 && blink == 0) {
+                startPrompt.draw(window);
+            }
             
-            // Blinking effect
-            if (((int)(timer.getElapsedTime().asSeconds() * 2)) % 2 == 0) {
-                window.draw(startPrompt);
+            // Load progress while the csv is still streaming in
+            if (loader.is_loading()) {
+                loadStatus.setString("Loading puzzles... " + to_string(loader.get_available_count()) + " (" +
+                                     to_string((int)(loader.get_load_progress() * 100)) + "%)");
+                loadStatus.draw(window);
             }
         }
         
         // MEMORIZING STATE - Show position with countdown
-        else if (gameState == MEMORIZING) {
-            drawPieces(window, solutionBoard);
+        else if (session.get_phase() == PHASE_MEMORIZING) {
+            if (puzzleFramesAvailable && session.get_board_count() == 1) {
+                // board and pieces in one go from the pre-rendered frame, then the palette pieces on top
+                drawPuzzleFrame(window, *currentFrame);
+            } else {
+                // every board of a grid goes into the one batch, so it's still a single draw call for the pieces
+                for (int board = 0; board < session.get_board_count(); board++) {
+                    appendBoardPieces(pieceBatch, session.get_solution(board), board);
+                }
+            }
+            drawPieceBatch(window, pieceBatch);
             
             // Memorization message at top
-            sf::Text memoryMessage(font);
-            memoryMessage.setCharacterSize(28);
-            memoryMessage.setFillColor(sf::Color::White);
-            memoryMessage.setOutlineColor(sf::Color::Black);
-            memoryMessage.setOutlineThickness(2);
-            memoryMessage.setString("Memorize this position!");
-            
-            sf::FloatRect msgBounds = memoryMessage.getLocalBounds();
-            memoryMessage.setOrigin(sf::Vector2f(msgBounds.position.x + msgBounds.size.x / 2.0f,
-                                   msgBounds.position.y + msgBounds.size.y / 2.0f));
-            memoryMessage.setPosition(sf::Vector2f(BOARD_SIZE / 2.0f, 40));
-            window.draw(memoryMessage);
+            memoryMessage.draw(window);
             
             // Countdown timer
-            sf::Text countdown(font);
-            countdown.setCharacterSize(72);
-            countdown.setFillColor(sf::Color(255, 100, 100));
-            countdown.setOutlineColor(sf::Color::Black);
-            countdown.setOutlineThickness(3);
-            
-            int timeLeft = (int)(displayTime - timer.getElapsedTime().asSeconds()) + 1;
-            countdown.setString(to_string(timeLeft));
-            
-            sf::FloatRect bounds = countdown.getLocalBounds();
-            countdown.setOrigin(sf::Vector2f(bounds.position.x + bounds.size.x / 2.0f,
-                               bounds.position.y + bounds.size.y / 2.0f));
-            countdown.setPosition(sf::Vector2f(BOARD_SIZE / 2.0f, BOARD_SIZE / 2.0f));
-            
-            window.draw(countdown);
+            countdownLabel.setString(to_string(countdown));
+            countdownLabel.draw(window);
         }
         
         // PLAYING STATE - Show user's recreation
-        else if (gameState == PLAYING) {
-            drawPieces(window, userBoard);
-            drawDraggedPiece(window, dragged);
+        else if (session.get_phase() == PHASE_PLAYING) {
+            for (int board = 0; board < session.get_board_count(); board++) {
+                appendBoardPieces(pieceBatch, session.get_user_board(board), board);
+            }
+            appendDraggedPiece(pieceBatch, session.get_piece_in_hand(), dragPosition);
+            drawPieceBatch(window, pieceBatch);
             
             // Instructions at top
-            sf::Text playInstructions(font);
-            playInstructions.setCharacterSize(18);
-            playInstructions.setFillColor(sf::Color(200, 200, 200));
-            playInstructions.setString("Recreate the position from memory - Press SPACE to check");
-            
-            sf::FloatRect playBounds = playInstructions.getLocalBounds();
-            playInstructions.setOrigin(sf::Vector2f(playBounds.position.x + playBounds.size.x / 2.0f,
-                                       playBounds.position.y + playBounds.size.y / 2.0f));
-            playInstructions.setPosition(sf::Vector2f(BOARD_SIZE / 2.0f, 25));
-            window.draw(playInstructions);
+            playInstructions.draw(window);
         }
         
         // Draw feedback message if active (overlays on any state)
-        if (showingFeedback) {
-            sf::Text feedback(font);
-            feedback.setCharacterSize(36);
+        if (session.is_showing_feedback()) {
+            // in a grid, a green or red frame around each board says which ones were right
+            if (session.get_board_count() > 1) {
+                boardOutlines.clear();
+                for (int board = 0; board < session.get_board_count(); board++) {
+                    bool perfect = session.get_board_correct_count(board) == 64;
+                    sf::Color color = perfect ? sf::Color(100, 255, 100) : sf::Color(255, 100, 100);
+                    appendBoardOutline(boardOutlines, board, color);
+                }
+                window.draw(boardOutlines);
+            }
             
             // Color based on message
-            if (feedbackMessage.find("CORRECT") != string::npos) {
-                feedback.setFillColor(sf::Color(100, 255, 100));
+            if (session.was_last_check_solved()) {
+                feedback.text.setFillColor(sf::Color(100, 255, 100));
             } else {
-                feedback.setFillColor(sf::Color(255, 200, 100));
+                feedback.text.setFillColor(sf::Color(255, 200, 100));
             }
             
-            feedback.setOutlineColor(sf::Color::Black);
-            feedback.setOutlineThickness(3);
-            feedback.setString(feedbackMessage);
-            
-            sf::FloatRect fbBounds = feedback.getLocalBounds();
-            feedback.setOrigin(sf::Vector2f(fbBounds.position.x + fbBounds.size.x / 2.0f,
-                              fbBounds.position.y + fbBounds.size.y / 2.0f));
-            feedback.setPosition(sf::Vector2f(BOARD_SIZE / 2.0f, BOARD_SIZE - 60));
-            
-            window.draw(feedback);
+            feedback.setString(session.get_feedback_message());
+            feedback.draw(window);
+        }
+        
+#ifdef MEMORY_CHESS_PROFILE
+        if (showProfileOverlay) {
+            char stats[64];
+            snprintf(stats, sizeof(stats), "frame p50 %.2f ms  p99 %.2f ms",
+                     frameTimes.percentile_ms(0.5), frameTimes.percentile_ms(0.99));
+            profileOverlay.setString(stats);
+            window.draw(profileOverlay);
+        }
+#endif
+        
+        {
+            PROFILE_SCOPE("display");
+            window.display();
         }
         
-        window.display();
+#ifdef MEMORY_CHESS_PROFILE
+        uint64_t frameEnd = profile_clock_ns();
+        profile_events.record("frame", frameStart, frameEnd - frameStart);
+        frameTimes.add(frameEnd - frameStart);
+#endif
     }
     
+    freeSimilarityBatch();
     return 0;
 }
\ No newline at end of file
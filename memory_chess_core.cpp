@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "board_state.cpp"
+
+using namespace std;
+
+// the game itself with no window attached: which phase we're in, the timers, the piece in hand, checking and scoring
+// a front end turns whatever it gets (mouse clicks, key presses, network messages, a simulator) into game_inputs and
+// feeds them to handle(), and calls update() now and then so the timers can move the game on. nothing here knows
+// about pixels or SFML, which is what lets the same session run behind a window, a server or a load test
+
+enum game_phase { PHASE_MENU, PHASE_MEMORIZING, PHASE_PLAYING };
+
+enum input_type {
+    INPUT_START,          // leave the menu with a first puzzle
+    INPUT_PICK_PIECE,     // pick piece up from the palette
+    INPUT_DROP_PIECE,     // put the piece in hand down on square of board, or square -1 to drop it off the board
+    INPUT_CLEAR_SQUARE,   // take whatever is on square of board off it
+    INPUT_CHECK,          // compare the recreation with the solution
+    INPUT_SHOW_SOLUTION,  // memorize the same position again
+    INPUT_CLEAR_BOARD,    // start the recreation over
+    INPUT_NEW_PUZZLE      // move on to a different puzzle
+};
+
+struct game_input {
+    input_type type;
+    char piece = ' ';
+    int square = -1;
+    // which of the puzzle's boards square is on, when several positions are memorized at once
+    int board = 0;
+};
+
+// most positions one puzzle can ask to memorize at once (a 4x4 grid)
+const int MAX_BOARDS = 16;
+
+// seconds since some fixed point in time. a session reads the time only through this, so a simulation can run
+// thousands of sessions a second by handing in a clock it moves forward itself
+using game_clock = function<double()>;
+
+inline double steady_clock_seconds() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// fills in the next puzzle to play, returns false if there is none (yet -- positions may still be loading)
+using puzzle_source = function<bool(board_state&)>;
+
+class game_session {
+    private:
+
+    puzzle_source next_puzzle;
+    game_clock clock;
+
+    game_phase phase = PHASE_MENU;
+    double phase_started = 0;
+    // how long the solution is shown for, per board
+    double display_time = 5.0;
+
+    // positions per puzzle from the next one on
+    int board_count = 1;
+    // one solution and one recreation per board of the current puzzle, side by side so they can be graded in one go
+    vector<board_state> solutions = vector<board_state>(1);
+    vector<board_state> user_boards = vector<board_state>(1);
+    char piece_in_hand = ' ';
+
+    string feedback_message;
+    bool showing_feedback = false;
+    double feedback_started = 0;
+    double feedback_display_time = 3.0;
+
+    // result of the last check: every board perfect, the squares correct over all boards, and per board
+    bool last_solved = false;
+    uint32_t last_correct = 0;
+    vector<uint32_t> board_correct;
+
+    void enter_phase(game_phase next) {
+        phase = next;
+        phase_started = clock();
+        piece_in_hand = ' ';
+    }
+
+    bool start_puzzle() {
+        vector<board_state> next(board_count);
+        for (board_state& puzzle : next) {
+            if (!next_puzzle(puzzle)) {
+                return false;
+            }
+        }
+        solutions = move(next);
+        begin_memorizing();
+        return true;
+    }
+
+    // shows the (new) solutions, with empty boards to recreate them on afterwards
+    void begin_memorizing() {
+        user_boards.assign(solutions.size(), board_state());
+        board_correct.clear();
+        showing_feedback = false;
+        enter_phase(PHASE_MEMORIZING);
+    }
+
+    // every board is graded in one grade_many pass
+    void check() {
+        size_t boards = solutions.size();
+        board_correct.resize(boards);
+        grade_many(user_boards.data(), solutions.data(), board_correct.data(), boards);
+        last_correct = 0;
+        size_t perfect = 0;
+        for (uint32_t correct : board_correct) {
+            last_correct += correct;
+            perfect += correct == 64;
+        }
+        last_solved = perfect == boards;
+        if (boards == 1) {
+            feedback_message = last_solved ? "CORRECT! Perfect match!"
+                                           : "Not quite! " + to_string(last_correct) + "/64 squares correct";
+        } else if (last_solved) {
+            feedback_message = "CORRECT! All " + to_string(boards) + " boards perfect!";
+        } else {
+            feedback_message = "Not quite! " + to_string(perfect) + "/" + to_string(boards) + " boards perfect, " +
+                               to_string(last_correct) + "/" + to_string(64 * boards) + " squares";
+        }
+        showing_feedback = true;
+        feedback_started = clock();
+    }
+
+    // the solutions are shown display_time for every board
+    double memorize_time() const {
+        return display_time * (double)solutions.size();
+    }
+
+    bool is_board(int board) const {
+        return board >= 0 && board < (int)user_boards.size();
+    }
+
+    public:
+
+    game_session(puzzle_source source, game_clock time_source = steady_clock_seconds)
+        : next_puzzle(move(source)), clock(move(time_source)) {
+        phase_started = clock();
+    }
+
+    void set_display_time(double seconds) { display_time = seconds; }
+    // how many positions every puzzle from the next one on asks to memorize at once, 1 to MAX_BOARDS
+    void set_board_count(int count) { board_count = max(1, min(count, MAX_BOARDS)); }
+    void set_feedback_display_time(double seconds) { feedback_display_time = seconds; }
+
+    // applies one input. returns false if it does nothing in the current phase (e.g. clicks while memorizing)
+    bool handle(const game_input& input) {
+        if (phase == PHASE_MENU) {
+            return input.type == INPUT_START && start_puzzle();
+        }
+        if (phase != PHASE_PLAYING) {
+            return false;
+        }
+
+        switch (input.type) {
+            case INPUT_PICK_PIECE:
+                if (piece_type_of(input.piece) == PIECE_TYPES) return false;
+                piece_in_hand = input.piece;
+                return true;
+
+            case INPUT_DROP_PIECE:
+                if (piece_in_hand == ' ') return false;
+                if (input.square >= 0 && input.square < 64 && is_board(input.board)) {
+                    user_boards[input.board].set_piece_at_square(input.square, piece_in_hand);
+                }
+                piece_in_hand = ' ';
+                return true;
+
+            case INPUT_CLEAR_SQUARE:
+                if (input.square < 0 || input.square >= 64 || !is_board(input.board)) return false;
+                user_boards[input.board].set_piece_at_square(input.square, ' ');
+                return true;
+
+            case INPUT_CHECK:
+                check();
+                return true;
+
+            case INPUT_SHOW_SOLUTION:
+                enter_phase(PHASE_MEMORIZING);
+                return true;
+
+            case INPUT_CLEAR_BOARD:
+                user_boards.assign(solutions.size(), board_state());
+                return true;
+
+            case INPUT_NEW_PUZZLE:
+                return start_puzzle();
+
+            default:
+                return false;
+        }
+    }
+
+    // plays puzzle next instead of asking the source, e.g. a position that looks like the one just got wrong
+    // only while playing a single board, like INPUT_NEW_PUZZLE; returns false otherwise
+    bool play_puzzle(const board_state& puzzle) {
+        if (phase != PHASE_PLAYING || solutions.size() != 1) {
+            return false;
+        }
+        solutions[0] = puzzle;
+        begin_memorizing();
+        return true;
+    }
+
+    // lets the timers move the game on: the solutions are hidden once memorize_time has passed, and feedback goes away
+    // after feedback_display_time. returns true if anything changed
+    bool update() {
+        double now = clock();
+        bool changed = false;
+        if (phase == PHASE_MEMORIZING && now - phase_started >= memorize_time()) {
+            enter_phase(PHASE_PLAYING);
+            changed = true;
+        }
+        if (showing_feedback && now - feedback_started >= feedback_display_time) {
+            showing_feedback = false;
+            changed = true;
+        }
+        return changed;
+    }
+
+    // seconds until update() changes something by itself or the countdown shows a new whole second, -1 if nothing is
+    // pending. a front end can sleep this long without missing anything
+    double seconds_until_next_change() const {
+        double now = clock();
+        double soonest = -1;
+        auto due_in = [&](double seconds) {
+            seconds = seconds < 0 ? 0 : seconds;
+            soonest = soonest < 0 ? seconds : min(soonest, seconds);
+        };
+        if (phase == PHASE_MEMORIZING) {
+            double left = memorize_time() - (now - phase_started);
+            due_in(left - (double)(int64_t)left);
+        }
+        if (showing_feedback) {
+            due_in(feedback_display_time - (now - feedback_started));
+        }
+        return soonest;
+    }
+
+    game_phase get_phase() const { return phase; }
+    double seconds_in_phase() const { return clock() - phase_started; }
+    // whole seconds left to memorize, counting the one in progress -- 5, 4, 3, 2, 1
+    int memorize_seconds_left() const { return (int)(memorize_time() - seconds_in_phase()) + 1; }
+
+    // boards of the current puzzle
+    int get_board_count() const { return (int)solutions.size(); }
+    const board_state& get_solution(int board = 0) const { return solutions[board]; }
+    const board_state& get_user_board(int board = 0) const { return user_boards[board]; }
+    // the piece being dragged, ' ' if none
+    char get_piece_in_hand() const { return piece_in_hand; }
+
+    bool is_showing_feedback() const { return showing_feedback; }
+    const string& get_feedback_message() const { return feedback_message; }
+    bool was_last_check_solved() const { return last_solved; }
+    uint32_t get_last_correct_count() const { return last_correct; }
+    // squares board got right in the last check, -1 if it hasn't been checked since the puzzle started
+    int get_board_correct_count(int board) const {
+        return board >= 0 && board < (int)board_correct.size() ? (int)board_correct[board] : -1;
+    }
+};
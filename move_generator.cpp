@@ -0,0 +1,562 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "bitboard_utils.cpp"
+#include "board_state.cpp"
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// chess moves on top of board_state's 12 bitboards: attack tables for every piece, legal move generation, make_move,
+// and replaying a lichess Moves column ("e2e4 e7e8q", uci notation) from the puzzle's FEN. a board_state only knows
+// where the pieces are, so chess_position adds the rest of what a FEN says: side to move, castling, en passant
+//
+// squares are numbered like everywhere else, 0 = a8 ... 63 = h1, so a white pawn moves towards square 0 (-8 a step)
+
+enum side_color { SIDE_WHITE, SIDE_BLACK };
+
+// piece_types of one side are the pawn's followed by knight, bishop, rook, queen, king, for both colours
+const int PAWN = 0, KNIGHT = 1, BISHOP = 2, ROOK = 3, QUEEN = 4, KING = 5;
+
+constexpr int first_piece(side_color side) {
+    return side == SIDE_WHITE ? WHITE_PAWN : BLACK_PAWN;
+}
+
+// "e3" -> square number, -1 if it isn't a square
+inline int parse_square(string_view name) {
+    if (name.size() != 2 || name[0] < 'a' || name[0] > 'h' || name[1] < '1' || name[1] > '8') {
+        return -1;
+    }
+    return ('8' - name[1]) * 8 + (name[0] - 'a');
+}
+
+// knight, king and pawn attacks from every square, worked out at compile time
+struct leaper_tables {
+    unsigned long long knight[64];
+    unsigned long long king[64];
+    // pawn[side][square]: the two (or one, on the edge) squares a pawn of that side attacks from square
+    unsigned long long pawn[2][64];
+};
+
+constexpr unsigned long long step_targets(int square, const int (*steps)[2], int count) {
+    unsigned long long targets = 0;
+    for (int i = 0; i < count; i++) {
+        int row = (square >> 3) + steps[i][0], file = (square & 7) + steps[i][1];
+        if (row >= 0 && row < 8 && file >= 0 && file < 8) {
+            targets |= 1ULL << (row * 8 + file);
+        }
+    }
+    return targets;
+}
+
+constexpr leaper_tables make_leaper_tables() {
+    // row and file steps, rows counted down the board from rank 8
+    const int knight_steps[8][2] = {{-2, -1}, {-2, 1}, {-1, -2}, {-1, 2}, {1, -2}, {1, 2}, {2, -1}, {2, 1}};
+    const int king_steps[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+    const int pawn_steps[2][2][2] = {{{-1, -1}, {-1, 1}}, {{1, -1}, {1, 1}}};
+    leaper_tables tables = {};
+    for (int square = 0; square < 64; square++) {
+        tables.knight[square] = step_targets(square, knight_steps, 8);
+        tables.king[square] = step_targets(square, king_steps, 8);
+        tables.pawn[SIDE_WHITE][square] = step_targets(square, pawn_steps[SIDE_WHITE], 2);
+        tables.pawn[SIDE_BLACK][square] = step_targets(square, pawn_steps[SIDE_BLACK], 2);
+    }
+    return tables;
+}
+
+constexpr leaper_tables LEAPER_ATTACKS = make_leaper_tables();
+
+static_assert(LEAPER_ATTACKS.knight[57] == ((1ULL << 40) | (1ULL << 42) | (1ULL << 51)), "knight on b1 reaches a3, c3, d2");
+
+// row and file steps of the rook (0) and bishop (1) rays
+constexpr int SLIDER_STEPS[2][4][2] = {{{-1, 0}, {1, 0}, {0, -1}, {0, 1}}, {{-1, -1}, {-1, 1}, {1, -1}, {1, 1}}};
+
+// squares a rook (or a bishop, if diagonal) attacks from square, up to and including the first occupied square of
+// each ray. the slow way, a square at a time -- only used to fill the tables
+constexpr unsigned long long slide_attacks(int square, unsigned long long occupied, bool diagonal) {
+    unsigned long long attacks = 0;
+    for (const auto& step : SLIDER_STEPS[diagonal]) {
+        int row = (square >> 3) + step[0], file = (square & 7) + step[1];
+        for (; row >= 0 && row < 8 && file >= 0 && file < 8; row += step[0], file += step[1]) {
+            unsigned long long bit = 1ULL << (row * 8 + file);
+            attacks |= bit;
+            if (occupied & bit) break;
+        }
+    }
+    return attacks;
+}
+
+// the squares whose occupancy changes the attacks from square: the rays without their last square (nothing is behind
+// the edge for a piece there to block)
+constexpr unsigned long long slider_mask(int square, bool diagonal) {
+    unsigned long long mask = 0;
+    for (const auto& step : SLIDER_STEPS[diagonal]) {
+        int row = (square >> 3) + step[0], file = (square & 7) + step[1];
+        for (; row + step[0] >= 0 && row + step[0] < 8 && file + step[1] >= 0 && file + step[1] < 8;
+             row += step[0], file += step[1]) {
+            mask |= 1ULL << (row * 8 + file);
+        }
+    }
+    return mask;
+}
+
+// magic multipliers: (occupied & mask) * magic >> (64 - bits in mask) gives every occupancy that matters its own slot
+// in the square's part of the table. found offline by a search from a fixed seed, for this square numbering
+const unsigned long long ROOK_MAGICS[64] = {
+    0x0080008010204008ULL, 0x2140100140006000ULL, 0x0280100080200008ULL, 0x0100100021000804ULL,
+    0x2900110008000402ULL, 0xD080020004008001ULL, 0x0480020011000080ULL, 0x81000C830000C022ULL,
+    0xC080800864824002ULL, 0x1000804000200080ULL, 0x140E004010208202ULL, 0x020A000822001042ULL,
+    0x3802800402080080ULL, 0x524E000844020011ULL, 0x0000808001000200ULL, 0x022200020320C08CULL,
+    0x0140008010816440ULL, 0x5820004010004020ULL, 0x8810002020040800ULL, 0x10002200400A0010ULL,
+    0x2011010008000410ULL, 0x0000808002000400ULL, 0x1840040008900102ULL, 0x82040A0008488104ULL,
+    0xAC40400180003080ULL, 0x0211008100204002ULL, 0x0210200080100080ULL, 0x8040080080801000ULL,
+    0x5004080080800400ULL, 0x8002000200100408ULL, 0x0801081400410210ULL, 0x4000008200042041ULL,
+    0x0100804000800022ULL, 0x08C0201000404000ULL, 0x0000200011004100ULL, 0x2000401022000A00ULL,
+    0x0008080080800400ULL, 0x0022002452001810ULL, 0x000100BC41000200ULL, 0x0100008402000061ULL,
+    0x8012648040008008ULL, 0x482000403000C000ULL, 0x0100100020008080ULL, 0x00C0420010220008ULL,
+    0x4401000800110004ULL, 0x400200080C4A0010ULL, 0x0040012810840042ULL, 0xA481040192420021ULL,
+    0x0400230D8000C100ULL, 0x1A44200040008680ULL, 0x1080801000200880ULL, 0x9000100008008480ULL,
+    0x0008800402080080ULL, 0x8000040080020080ULL, 0x38C0810208100400ULL, 0x0080040059008200ULL,
+    0x8906228000401701ULL, 0x0002001020428302ULL, 0x0000410008200011ULL, 0x0084050008201001ULL,
+    0x0081001008000615ULL, 0x0002002C18099002ULL, 0x002804B0081B0204ULL, 0x040004008C402902ULL
+};
+
+const unsigned long long BISHOP_MAGICS[64] = {
+    0x0008200400882100ULL, 0x4520081101082009ULL, 0x0004084091002A00ULL, 0x0002408100010044ULL,
+    0x08141044A6280020ULL, 0x0800901048080000ULL, 0x0004024802881228ULL, 0x0011010801040200ULL,
+    0x8A24511001180880ULL, 0x0010B82200A40500ULL, 0x0A884820851A0080ULL, 0x0000080A08204B00ULL,
+    0x0011011040000100ULL, 0x0008084802100408ULL, 0x00810144106C1021ULL, 0x8050005100882001ULL,
+    0x0008210420280202ULL, 0x0110502004010061ULL, 0x0010001108448102ULL, 0x001024280423C000ULL,
+    0x0850102202101000ULL, 0xC080400A04500400ULL, 0x4802010882504200ULL, 0x0042080042120104ULL,
+    0x008240060A504400ULL, 0x00240401A0480082ULL, 0x1108040202040015ULL, 0x0012080084004008ULL,
+    0x024100401400404CULL, 0x0030044018880800ULL, 0x0018008002122100ULL, 0x80040100108080A6ULL,
+    0x80D00804D0A00440ULL, 0x0208021100028C05ULL, 0x0220482200101400ULL, 0x0022010040140040ULL,
+    0x0404200200022080ULL, 0x4021080200042209ULL, 0x0010021200044140ULL, 0x400A01A428020200ULL,
+    0x001C300804010801ULL, 0x4101141004898221ULL, 0x0052010402008100ULL, 0x2061212128042400ULL,
+    0x22A1C0010A000104ULL, 0x8882501005080480ULL, 0x0044480200602400ULL, 0x1202080041060081ULL,
+    0x0002080D04500801ULL, 0x0232008201104400ULL, 0x8410022211300010ULL, 0x8020000C46080000ULL,
+    0x100000784B040000ULL, 0x0800200202520000ULL, 0x0010041080820000ULL, 0x0210044104002060ULL,
+    0x0A20820100A08404ULL, 0x0002010121012000ULL, 0x0D40C20200541200ULL, 0x4000980004208840ULL,
+    0x00000000B0820A02ULL, 0x0005000584180200ULL, 0x4000082108008900ULL, 0x0410020204002202ULL
+};
+
+struct slider_square {
+    unsigned long long mask;
+    unsigned long long magic;
+    uint32_t shift;
+    // where the square's slots start in slider_attack_tables::attacks
+    uint32_t offset;
+};
+
+// slot of occupied in the square's part of the table. with BMI2 pext packs the mask bits of occupied straight into an
+// index, no multiply and no magic needed (-march=native; it's slow microcode on AMD before Zen 3, where the magics
+// are the better choice)
+inline size_t slider_slot(const slider_square& entry, unsigned long long occupied) {
+#ifdef __BMI2__
+    return entry.offset + (size_t)_pext_u64(occupied, entry.mask);
+#else
+    return entry.offset + (size_t)(((occupied & entry.mask) * entry.magic) >> entry.shift);
+#endif
+}
+
+// rook and bishop attacks of every square for every occupancy of its mask: 102400 rook and 5248 bishop slots, 840 KB
+class slider_attack_tables {
+    private:
+
+    void fill_square(slider_square& entry, int square, unsigned long long magic, bool diagonal) {
+        entry.mask = slider_mask(square, diagonal);
+        entry.magic = magic;
+        entry.shift = 64 - popcount64(entry.mask);
+        entry.offset = (uint32_t)attacks.size();
+        attacks.resize(attacks.size() + (size_t(1) << popcount64(entry.mask)));
+        // every subset of the mask, counting up through its bits (the carry-rippler trick)
+        unsigned long long subset = 0;
+        do {
+            attacks[slider_slot(entry, subset)] = slide_attacks(square, subset, diagonal);
+            subset = (subset - entry.mask) & entry.mask;
+        } while (subset != 0);
+    }
+
+    public:
+
+    slider_square rook[64];
+    slider_square bishop[64];
+    vector<unsigned long long> attacks;
+
+    slider_attack_tables() {
+        attacks.reserve(102400 + 5248);
+        for (int square = 0; square < 64; square++) {
+            fill_square(rook[square], square, ROOK_MAGICS[square], false);
+            fill_square(bishop[square], square, BISHOP_MAGICS[square], true);
+        }
+    }
+};
+
+// built the first time a slider's attacks are asked for, so programs that never look at moves don't pay for it
+inline const slider_attack_tables& slider_tables() {
+    static const slider_attack_tables tables;
+    return tables;
+}
+
+inline unsigned long long rook_attacks(int square, unsigned long long occupied) {
+    const slider_attack_tables& tables = slider_tables();
+    return tables.attacks[slider_slot(tables.rook[square], occupied)];
+}
+
+inline unsigned long long bishop_attacks(int square, unsigned long long occupied) {
+    const slider_attack_tables& tables = slider_tables();
+    return tables.attacks[slider_slot(tables.bishop[square], occupied)];
+}
+
+// whether a piece of side by attacks square, given 12 bitboards indexed by piece_type and the occupancy to slide
+// through. pieces on removed squares don't count (a piece a move would capture), which together with the occupancy
+// lets a move be tried out without making it
+inline bool is_attacked(const unsigned long long* boards, int square, side_color by, unsigned long long occupied,
+                        unsigned long long removed = 0) {
+    const unsigned long long* attackers = boards + first_piece(by);
+    unsigned long long kept = ~removed;
+    unsigned long long queens = attackers[QUEEN] & kept;
+    // a pawn of by attacks square exactly when a pawn of the other side on square would attack the pawn
+    return (LEAPER_ATTACKS.pawn[by ^ 1][square] & attackers[PAWN] & kept) != 0 ||
+           (LEAPER_ATTACKS.knight[square] & attackers[KNIGHT] & kept) != 0 ||
+           (LEAPER_ATTACKS.king[square] & attackers[KING] & kept) != 0 ||
+           (bishop_attacks(square, occupied) & ((attackers[BISHOP] & kept) | queens)) != 0 ||
+           (rook_attacks(square, occupied) & ((attackers[ROOK] & kept) | queens)) != 0;
+}
+
+// cheap checks every position from a real game passes: one king a side, no pawns on the first or last rank, at most
+// 16 pieces and 8 pawns a side, and the side that just moved isn't in check. a handful of popcounts and one attack
+// test, so the loader can throw out corrupt rows without generating a single move
+inline bool is_legal_placement(const unsigned long long* boards, side_color side_to_move) {
+    const unsigned long long back_ranks = 0xFF000000000000FFULL;
+    for (side_color side : {SIDE_WHITE, SIDE_BLACK}) {
+        const unsigned long long* pieces = boards + first_piece(side);
+        unsigned long long all = 0;
+        for (int piece = PAWN; piece <= KING; piece++) {
+            all |= pieces[piece];
+        }
+        if (popcount64(pieces[KING]) != 1 || popcount64(pieces[PAWN]) > 8 || popcount64(all) > 16 ||
+            (pieces[PAWN] & back_ranks) != 0) {
+            return false;
+        }
+    }
+    unsigned long long occupied = 0;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        occupied |= boards[type];
+    }
+    side_color waiting = (side_color)(side_to_move ^ 1);
+    int king = lowest_bit_index(boards[first_piece(waiting) + KING]);
+    return !is_attacked(boards, king, side_to_move, occupied);
+}
+
+// side to move field of a FEN ("... b KQkq - 0 1"), white if it's missing
+inline side_color fen_side_to_move(string_view fen) {
+    size_t space = fen.find(' ');
+    return space != string_view::npos && space + 1 < fen.size() && fen[space + 1] == 'b' ? SIDE_BLACK : SIDE_WHITE;
+}
+
+const uint8_t CASTLE_WHITE_KING = 1;
+const uint8_t CASTLE_WHITE_QUEEN = 2;
+const uint8_t CASTLE_BLACK_KING = 4;
+const uint8_t CASTLE_BLACK_QUEEN = 8;
+
+// castling rights still there after a move from or to square: a king or rook leaving home, or a rook captured there
+constexpr uint8_t castling_kept(int square) {
+    switch (square) {
+        case 0: return (uint8_t)~CASTLE_BLACK_QUEEN;
+        case 4: return (uint8_t)~(CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN);
+        case 7: return (uint8_t)~CASTLE_BLACK_KING;
+        case 56: return (uint8_t)~CASTLE_WHITE_QUEEN;
+        case 60: return (uint8_t)~(CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN);
+        case 63: return (uint8_t)~CASTLE_WHITE_KING;
+        default: return 0xFF;
+    }
+}
+
+const uint8_t MOVE_DOUBLE_PUSH = 1;
+const uint8_t MOVE_EN_PASSANT = 2;
+const uint8_t MOVE_CASTLE = 4;
+
+struct chess_move {
+    uint8_t from;
+    uint8_t to;
+    // piece_type the pawn becomes, PIECE_TYPES if this isn't a promotion
+    uint8_t promotion;
+    uint8_t flags;
+};
+
+// no position has more than 218 legal moves
+struct move_list {
+    chess_move moves[256];
+    int count = 0;
+};
+
+class chess_position {
+    private:
+
+    board_state board;
+    side_color side = SIDE_WHITE;
+    uint8_t castling = 0;
+    // the square a pawn can capture onto en passant, -1 if there is none
+    int en_passant = -1;
+
+    // whether the side to move's king (on king) is safe after from -> to, with the piece on captured taken off -- that
+    // is to for an ordinary move, or the pawn an en passant capture takes
+    bool keeps_king_safe(int from, int to, int captured, int king) const {
+        unsigned long long occupied = (board.occupancy() & ~(1ULL << from) & ~(1ULL << captured)) | (1ULL << to);
+        return !is_attacked(board.get_bitboards(), from == king ? to : king, (side_color)(side ^ 1), occupied,
+                            1ULL << captured);
+    }
+
+    public:
+
+    // parses the whole FEN: placement, side to move, castling and en passant (the move counters are ignored). rights
+    // the pieces can't back up are dropped -- a king or rook off its home square, or an en passant square without the
+    // pawn that just got past it -- so a corrupt FEN can't make a move out of thin air
+    bool populate_from_FEN(string_view fen) {
+        if (!board.populate_from_FEN(fen)) {
+            return false;
+        }
+        string_view fields[3];
+        size_t start = fen.find(' ');
+        for (string_view& field : fields) {
+            if (start == string_view::npos) break;
+            size_t end = fen.find(' ', start + 1);
+            field = fen.substr(start + 1, end == string_view::npos ? string_view::npos : end - start - 1);
+            start = end;
+        }
+        if (!fields[0].empty() && fields[0] != "w" && fields[0] != "b") {
+            return false;
+        }
+        side = fields[0] == "b" ? SIDE_BLACK : SIDE_WHITE;
+
+        castling = 0;
+        for (char c : fields[1]) {
+            switch (c) {
+                case 'K': castling |= CASTLE_WHITE_KING; break;
+                case 'Q': castling |= CASTLE_WHITE_QUEEN; break;
+                case 'k': castling |= CASTLE_BLACK_KING; break;
+                case 'q': castling |= CASTLE_BLACK_QUEEN; break;
+            }
+        }
+        const int homes[4][2] = {{60, 63}, {60, 56}, {4, 7}, {4, 0}};
+        const char pieces[4][2] = {{'K', 'R'}, {'K', 'R'}, {'k', 'r'}, {'k', 'r'}};
+        for (int right = 0; right < 4; right++) {
+            if (board.get_piece_at(homes[right][0]) != pieces[right][0] ||
+                board.get_piece_at(homes[right][1]) != pieces[right][1]) {
+                castling &= ~(1 << right);
+            }
+        }
+
+        // the pawn that just moved two squares is one step past the en passant square, from the side to move
+        en_passant = parse_square(fields[2]);
+        int passed = side == SIDE_WHITE ? en_passant + 8 : en_passant - 8;
+        if (en_passant >= 0 && ((en_passant >> 3) != (side == SIDE_WHITE ? 2 : 5) ||
+                                board.get_piece_at(passed) != (side == SIDE_WHITE ? 'p' : 'P'))) {
+            en_passant = -1;
+        }
+        return true;
+    }
+
+    const board_state& get_board() const {
+        return board;
+    }
+
+    side_color side_to_move() const {
+        return side;
+    }
+
+    bool in_check() const {
+        unsigned long long king = board.get_bitboard((piece_type)(first_piece(side) + KING));
+        return king != 0 && is_attacked(board.get_bitboards(), lowest_bit_index(king), (side_color)(side ^ 1),
+                                        board.occupancy());
+    }
+
+    // see is_legal_placement
+    bool is_legal_position() const {
+        return is_legal_placement(board.get_bitboards(), side);
+    }
+
+    // every legal move of the side to move. pseudo legal moves come straight from the attack tables, and each is
+    // kept only if is_attacked finds the king safe on the board as it would be after the move -- which covers pins,
+    // checks and the en passant capture that uncovers a rank all the same way, without making the move
+    void generate_moves(move_list& list) const {
+        list.count = 0;
+        const unsigned long long* boards = board.get_bitboards();
+        const unsigned long long* pieces = boards + first_piece(side);
+        side_color them = (side_color)(side ^ 1);
+        if (pieces[KING] == 0) {
+            return;
+        }
+        int king = lowest_bit_index(pieces[KING]);
+        unsigned long long occupied = board.occupancy();
+        unsigned long long own = pieces[PAWN] | pieces[KNIGHT] | pieces[BISHOP] | pieces[ROOK] | pieces[QUEEN] | pieces[KING];
+        unsigned long long enemy = occupied & ~own;
+
+        auto add = [&](int from, int to, int captured, int promotion, uint8_t flags) {
+            if (keeps_king_safe(from, to, captured, king)) {
+                list.moves[list.count++] = {(uint8_t)from, (uint8_t)to, (uint8_t)promotion, flags};
+            }
+        };
+        auto add_targets = [&](int from, unsigned long long targets) {
+            for (targets &= ~own; targets != 0; targets &= targets - 1) {
+                int to = lowest_bit_index(targets);
+                add(from, to, to, PIECE_TYPES, 0);
+            }
+        };
+
+        int forward = side == SIDE_WHITE ? -8 : 8;
+        int start_row = side == SIDE_WHITE ? 6 : 1;
+        int last_row = side == SIDE_WHITE ? 0 : 7;
+        // a pawn on a back rank can't be there (and would walk off the board), so those are left out
+        for (unsigned long long pawns = pieces[PAWN] & 0x00FFFFFFFFFFFF00ULL; pawns != 0; pawns &= pawns - 1) {
+            int from = lowest_bit_index(pawns);
+            auto add_pawn_move = [&](int to, int captured, uint8_t flags) {
+                if ((to >> 3) != last_row) {
+                    add(from, to, captured, PIECE_TYPES, flags);
+                    return;
+                }
+                for (int piece : {QUEEN, ROOK, BISHOP, KNIGHT}) {
+                    add(from, to, captured, first_piece(side) + piece, flags);
+                }
+            };
+            int one = from + forward;
+            if (!((occupied >> one) & 1)) {
+                add_pawn_move(one, one, 0);
+                int two = one + forward;
+                if ((from >> 3) == start_row && !((occupied >> two) & 1)) {
+                    add_pawn_move(two, two, MOVE_DOUBLE_PUSH);
+                }
+            }
+            for (unsigned long long captures = LEAPER_ATTACKS.pawn[side][from] & enemy; captures != 0;
+                 captures &= captures - 1) {
+                int to = lowest_bit_index(captures);
+                add_pawn_move(to, to, 0);
+            }
+            if (en_passant >= 0 && ((LEAPER_ATTACKS.pawn[side][from] >> en_passant) & 1)) {
+                add_pawn_move(en_passant, en_passant - forward, MOVE_EN_PASSANT);
+            }
+        }
+        for (unsigned long long knights = pieces[KNIGHT]; knights != 0; knights &= knights - 1) {
+            int from = lowest_bit_index(knights);
+            add_targets(from, LEAPER_ATTACKS.knight[from]);
+        }
+        for (unsigned long long bishops = pieces[BISHOP] | pieces[QUEEN]; bishops != 0; bishops &= bishops - 1) {
+            int from = lowest_bit_index(bishops);
+            add_targets(from, bishop_attacks(from, occupied));
+        }
+        for (unsigned long long rooks = pieces[ROOK] | pieces[QUEEN]; rooks != 0; rooks &= rooks - 1) {
+            int from = lowest_bit_index(rooks);
+            add_targets(from, rook_attacks(from, occupied));
+        }
+        add_targets(king, LEAPER_ATTACKS.king[king]);
+
+        // castling: the squares between king and rook empty, and the king not in check and not passing through or
+        // landing on an attacked square. the rights are only kept while king and rook are at home
+        uint8_t king_side = side == SIDE_WHITE ? CASTLE_WHITE_KING : CASTLE_BLACK_KING;
+        uint8_t queen_side = side == SIDE_WHITE ? CASTLE_WHITE_QUEEN : CASTLE_BLACK_QUEEN;
+        if ((castling & (king_side | queen_side)) && !is_attacked(boards, king, them, occupied)) {
+            // a file square of the back rank
+            int home = side == SIDE_WHITE ? 56 : 0;
+            if ((castling & king_side) && !(occupied & (3ULL << (home + 5))) &&
+                !is_attacked(boards, home + 5, them, occupied) && !is_attacked(boards, home + 6, them, occupied)) {
+                list.moves[list.count++] = {(uint8_t)(home + 4), (uint8_t)(home + 6), PIECE_TYPES, MOVE_CASTLE};
+            }
+            if ((castling & queen_side) && !(occupied & (7ULL << (home + 1))) &&
+                !is_attacked(boards, home + 3, them, occupied) && !is_attacked(boards, home + 2, them, occupied)) {
+                list.moves[list.count++] = {(uint8_t)(home + 4), (uint8_t)(home + 2), PIECE_TYPES, MOVE_CASTLE};
+            }
+        }
+    }
+
+    // plays a move from generate_moves. the bitboards, mailbox and hash of the board are all kept up to date
+    void make_move(const chess_move& move) {
+        int forward = side == SIDE_WHITE ? -8 : 8;
+        if (move.flags & MOVE_EN_PASSANT) {
+            board.set_piece_at_square(move.to - forward, ' ');
+        }
+        board.move_piece(move.from, move.to);
+        if (move.promotion != PIECE_TYPES) {
+            board.set_piece_at_square(move.to, PIECE_CHARS[move.promotion]);
+        }
+        if (move.flags & MOVE_CASTLE) {
+            // the rook goes to the square the king passed over
+            if (move.to > move.from) {
+                board.move_piece(move.to + 1, move.to - 1);
+            }
+            else {
+                board.move_piece(move.to - 2, move.to + 1);
+            }
+        }
+        castling &= castling_kept(move.from) & castling_kept(move.to);
+        en_passant = (move.flags & MOVE_DOUBLE_PUSH) ? move.from + forward : -1;
+        side = (side_color)(side ^ 1);
+    }
+
+    // plays a move given in uci notation ("e2e4", "e7e8q", castling as the king's move "e1g1"). returns false, and
+    // changes nothing, if it isn't a legal move here
+    bool play_uci(string_view uci) {
+        if (uci.size() != 4 && uci.size() != 5) {
+            return false;
+        }
+        int from = parse_square(uci.substr(0, 2));
+        int to = parse_square(uci.substr(2, 2));
+        int promotion = PIECE_TYPES;
+        if (uci.size() == 5) {
+            // uci promotions are always lower case
+            char piece = side == SIDE_WHITE ? (char)toupper((unsigned char)uci[4]) : uci[4];
+            promotion = piece_type_of(piece);
+            if (promotion == PIECE_TYPES) return false;
+        }
+        move_list moves;
+        generate_moves(moves);
+        for (int i = 0; i < moves.count; i++) {
+            const chess_move& move = moves.moves[i];
+            if (move.from == from && move.to == to && move.promotion == promotion) {
+                make_move(move);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // plays a space separated list of uci moves, like a lichess Moves column. false at the first one that isn't
+    // legal, with the moves before it played
+    bool play_uci_moves(string_view moves) {
+        while (!moves.empty()) {
+            size_t space = moves.find(' ');
+            string_view move = moves.substr(0, space);
+            if (!move.empty() && !play_uci(move)) {
+                return false;
+            }
+            moves = space == string_view::npos ? string_view() : moves.substr(space + 1);
+        }
+        return true;
+    }
+};
+
+// number of move sequences depth moves long -- perft, the standard way to check a move generator against counts
+// everybody agrees on. the last move is only counted, not made
+uint64_t perft(const chess_position& position, int depth) {
+    if (depth <= 0) {
+        return 1;
+    }
+    move_list moves;
+    position.generate_moves(moves);
+    if (depth == 1) {
+        return (uint64_t)moves.count;
+    }
+    uint64_t nodes = 0;
+    for (int i = 0; i < moves.count; i++) {
+        chess_position next = position;
+        next.make_move(moves.moves[i]);
+        nodes += perft(next, depth - 1);
+    }
+    return nodes;
+}
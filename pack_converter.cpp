@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include "board_state.cpp"
+#include "compressed_input.cpp"
+#include "puzzle_themes.cpp"
+#include "position_pack.cpp"
+#include "position_loader.cpp"
+
+using namespace std;
+
+// offline converter: lichess_db_puzzle.csv -> lichess_db_puzzle.pack
+// also converts straight from the compressed download (.csv.zst / .csv.gz), without unpacking it to disk first
+//
+//   pack_converter lichess_db_puzzle.csv lichess_db_puzzle.pack
+//   pack_converter lichess_db_puzzle.csv.zst lichess_db_puzzle.pack
+//   pack_converter --verify lichess_db_puzzle.pack
+
+bool ends_with(const string& text, const string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int convert(const string& csv_filename, const string& pack_filename) {
+    // only the rows are wanted from the loader: they are checked and the duplicates dropped below, so we can report
+    // how many there were
+    position_loader loader;
+    decompressing_reader compressed;
+    bool streaming = ends_with(csv_filename, ".zst") || ends_with(csv_filename, ".gz");
+    if (streaming ? !compressed.open(csv_filename) : !loader.load_position_mapped(csv_filename, false)) {
+        return 1;
+    }
+
+    FILE* out = fopen(pack_filename.c_str(), "wb");
+    if (out == nullptr) {
+        cerr << "Error, we could not create the file: " << pack_filename << endl;
+        return 1;
+    }
+
+    // write a placeholder header first, then come back and fill in the count and checksum once we know them
+    pack_header header = {};
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.record_size = sizeof(pack_record);
+    fwrite(&header, sizeof(header), 1, out);
+
+    uint64_t checksum = pack_checksum(nullptr, 0);
+    uint32_t skipped = 0;
+    uint32_t duplicates = 0;
+    // theme tags PUZZLE_THEMES doesn't know yet are left out of the pack. that's fine for a while, but someone should
+    // add them, so say so (once, not for every row that has one)
+    bool warned_unknown_theme = false;
+    board_state board;
+    seen_positions seen;
+    seen.reserve(loader.get_mapped_count());
+
+    auto convert_row = [&](string_view row) {
+        pack_record record = {};
+        // an empty board is a row that can't be played (no kings), see playable_position
+        board = loader.get_row_board(row);
+        if (board.occupancy() == 0 || !pack_board(board, record)) {
+            skipped++;
+            return true;
+        }
+        if (!seen.insert(board.get_hash())) {
+            duplicates++;
+            return true;
+        }
+
+        string_view id = csv_field(row, COLUMN_ID);
+        memcpy(record.puzzle_id, id.data(), min(id.size(), sizeof(record.puzzle_id)));
+        record.rating = parse_number<uint16_t>(csv_field(row, COLUMN_RATING), 0);
+        record.popularity = parse_number<int16_t>(csv_field(row, COLUMN_POPULARITY), 0);
+        record.nb_plays = parse_number<uint32_t>(csv_field(row, COLUMN_PLAYS), 0);
+        string_view unknown_theme;
+        record.themes = parse_themes(csv_field(row, COLUMN_THEMES), &unknown_theme);
+        if (!unknown_theme.empty() && !warned_unknown_theme) {
+            cerr << "Warning: unknown theme \"" << unknown_theme << "\" is left out of the pack (and any other "
+                 << "new ones), add it to the end of PUZZLE_THEMES" << endl;
+            warned_unknown_theme = true;
+        }
+
+        fwrite(&record, sizeof(record), 1, out);
+        checksum = pack_checksum(&record, sizeof(record), checksum);
+        header.record_count++;
+        return true;
+    };
+    if (streaming) {
+        if (!stream_csv_rows(compressed, convert_row)) {
+            cerr << "Error, " << csv_filename << " is corrupt or cut short" << endl;
+            fclose(out);
+            return 1;
+        }
+    }
+    else {
+        for (uint32_t i = 0; i < loader.get_mapped_count(); i++) {
+            convert_row(loader.get_mapped_row(i));
+        }
+    }
+
+    header.checksum = checksum;
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    bool write_failed = ferror(out) != 0;
+    if (fclose(out) != 0 || write_failed) {
+        cerr << "Error, failed writing: " << pack_filename << endl;
+        return 1;
+    }
+
+    cout << "Packed " << header.record_count << " positions into " << pack_filename;
+    if (skipped > 0) {
+        cout << " (skipped " << skipped << " bad rows)";
+    }
+    if (duplicates > 0) {
+        cout << " (dropped " << duplicates << " duplicate positions)";
+    }
+    cout << endl;
+    return 0;
+}
+
+int verify(const string& pack_filename) {
+    position_loader loader;
+    if (!loader.open_position_pack(pack_filename, true)) {
+        cerr << "Error, could not open a valid pack: " << pack_filename << endl;
+        return 1;
+    }
+    cout << pack_filename << ": " << loader.get_pack_count() << " positions, checksum ok" << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 3 && string(argv[1]) == "--verify") {
+        return verify(argv[2]);
+    }
+    if (argc == 3) {
+        return convert(argv[1], argv[2]);
+    }
+    cerr << "usage: " << argv[0] << " <puzzles.csv | puzzles.csv.zst | puzzles.csv.gz> <puzzles.pack>" << endl;
+    cerr << "       " << argv[0] << " --verify <puzzles.pack>" << endl;
+    return 1;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "board_state.cpp"
+#include "position_pack.cpp"
+
+using namespace std;
+
+// millions of positions in as little memory as possible, all in one contiguous arena
+//
+// each position is its occupancy bitboard (8 bytes) followed by a 4 bit piece code per occupied square (the same
+// nibbles as a pack_record, but only as many bytes as the position needs). a typical puzzle position has 15-25
+// pieces, so that's 16-21 bytes, plus a 4 byte offset to find it -- against ~90 bytes for a FEN in a vector<string>
+// or 96+ bytes for a board_state. getting one back is a walk over its occupied squares, no text involved
+class packed_position_store {
+    private:
+
+    vector<uint8_t> arena;
+    // where each position starts in the arena
+    vector<uint32_t> offsets;
+
+    public:
+
+    // room for positions positions of about bytes_each bytes, to avoid regrowing the arena while filling it
+    void reserve(size_t positions, size_t bytes_each = 20) {
+        arena.reserve(positions * bytes_each);
+        offsets.reserve(positions);
+    }
+
+    // occupancy plus its piece nibbles, (popcount(occupancy) + 1) / 2 bytes of them
+    // returns false for more than 32 pieces, or once the arena is past what a 32 bit offset can reach (~4 GB)
+    bool add_packed(uint64_t occupancy, const uint8_t* pieces) {
+        int count = popcount64(occupancy);
+        size_t piece_bytes = (count + 1) / 2;
+        if (count > 32 || arena.size() + sizeof(occupancy) + piece_bytes > UINT32_MAX) {
+            return false;
+        }
+        offsets.push_back((uint32_t)arena.size());
+        const uint8_t* occupancy_bytes = reinterpret_cast<const uint8_t*>(&occupancy);
+        arena.insert(arena.end(), occupancy_bytes, occupancy_bytes + sizeof(occupancy));
+        arena.insert(arena.end(), pieces, pieces + piece_bytes);
+        return true;
+    }
+
+    bool add(const board_state& board) {
+        uint8_t pieces[32] = {};
+        if (popcount64(board.occupancy()) > 32) {
+            return false;
+        }
+        pack_pieces(board, pieces);
+        return add_packed(board.occupancy(), pieces);
+    }
+
+    size_t size() const {
+        return offsets.size();
+    }
+
+    // bytes held, arena and offsets together
+    size_t memory_bytes() const {
+        return arena.capacity() + offsets.capacity() * sizeof(uint32_t);
+    }
+
+    // drops the slack left by reserve or growth once everything has been added
+    void shrink_to_fit() {
+        arena.shrink_to_fit();
+        offsets.shrink_to_fit();
+    }
+
+    uint64_t get_occupancy(size_t index) const {
+        uint64_t occupancy;
+        memcpy(&occupancy, arena.data() + offsets[index], sizeof(occupancy));
+        return occupancy;
+    }
+
+    // the piece nibbles of a position, (popcount(get_occupancy(index)) + 1) / 2 bytes
+    const uint8_t* get_pieces(size_t index) const {
+        return arena.data() + offsets[index] + sizeof(uint64_t);
+    }
+
+    void get(size_t index, board_state& board) const {
+        board.set_packed_pieces(get_occupancy(index), get_pieces(index));
+    }
+
+    board_state get(size_t index) const {
+        board_state board;
+        get(index, board);
+        return board;
+    }
+};
@@ -0,0 +1,96 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "move_generator.cpp"
+
+using namespace std;
+
+// perft for the move generator: counts every move sequence a few moves deep and compares with the counts everybody
+// agrees on, which catches a missing or extra move anywhere in the tree. also times it
+//
+//   perft                          the standard test positions, fails if any count is off
+//   perft "<fen>" 5                one position, with the count under each first move (to chase a mismatch)
+
+struct perft_case {
+    const char* name;
+    const char* fen;
+    int depth;
+    uint64_t nodes;
+};
+
+// the usual suite (chessprogramming wiki "Perft Results"), deep enough to go through castling, en passant,
+// promotions and discovered checks, small enough to run in a few seconds
+const perft_case PERFT_CASES[] = {
+    {"start", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 5, 4865609},
+    {"kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4, 4085603},
+    {"position 3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624},
+    {"position 4", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 4, 422333},
+    {"position 5", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4, 2103487},
+    {"position 6", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4, 3894594},
+};
+
+string square_name(int square) {
+    return string(1, (char)('a' + (square & 7))) + (char)('8' - (square >> 3));
+}
+
+int run_suite() {
+    int failures = 0;
+    uint64_t total_nodes = 0;
+    double total_seconds = 0;
+    for (const perft_case& test : PERFT_CASES) {
+        chess_position position;
+        position.populate_from_FEN(test.fen);
+        auto start_time = chrono::steady_clock::now();
+        uint64_t nodes = perft(position, test.depth);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        total_nodes += nodes;
+        total_seconds += seconds;
+        bool passed = nodes == test.nodes;
+        failures += !passed;
+        cout << (passed ? "ok    " : "FAIL  ") << test.name << " depth " << test.depth << ": " << nodes;
+        if (!passed) {
+            cout << " (expected " << test.nodes << ")";
+        }
+        cout << "  " << seconds * 1000 << " ms" << endl;
+    }
+    cout << total_nodes << " nodes in " << total_seconds << " s (" << (uint64_t)(total_nodes / max(total_seconds, 1e-9))
+         << " nodes/s)" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+int divide(const string& fen, int depth) {
+    chess_position position;
+    if (!position.populate_from_FEN(fen)) {
+        cerr << "Error, not a valid FEN: " << fen << endl;
+        return 1;
+    }
+    move_list moves;
+    position.generate_moves(moves);
+    uint64_t total = 0;
+    for (int i = 0; i < moves.count; i++) {
+        const chess_move& move = moves.moves[i];
+        chess_position next = position;
+        next.make_move(move);
+        uint64_t nodes = perft(next, depth - 1);
+        total += nodes;
+        cout << square_name(move.from) << square_name(move.to);
+        if (move.promotion != PIECE_TYPES) {
+            cout << (char)tolower((unsigned char)PIECE_CHARS[move.promotion]);
+        }
+        cout << ": " << nodes << endl;
+    }
+    cout << "total: " << total << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 1) {
+        return run_suite();
+    }
+    if (argc == 3) {
+        return divide(argv[1], max(atoi(argv[2]), 1));
+    }
+    cerr << "usage: " << argv[0] << " [<fen> <depth>]" << endl;
+    return 1;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "bitboard_utils.cpp"
+#include "board_state.cpp"
+
+using namespace std;
+
+// how hard a position is to memorize, from its pieces alone: how many there are and of which kinds, how far they are
+// spread over the board, how symmetric they sit, and how far the position is from the starting position (pieces
+// still on their home squares are easy to remember). all of it folds into one 0-100 difficulty for picking puzzles
+//
+// computed for a whole csv in parallel by feature_extractor and cached next to it (lichess_db_puzzle.csv.features),
+// together with whether each row can be played at all and whether it repeats an earlier one. with that, the
+// loader's index build never has to parse a FEN
+
+constexpr unsigned long long make_start_bitboard(int type) {
+    unsigned long long boards[PIECE_TYPES] = {};
+    parse_fen_placement("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR", boards);
+    return boards[type];
+}
+
+constexpr unsigned long long START_BITBOARDS[PIECE_TYPES] = {
+    make_start_bitboard(0), make_start_bitboard(1), make_start_bitboard(2), make_start_bitboard(3),
+    make_start_bitboard(4), make_start_bitboard(5), make_start_bitboard(6), make_start_bitboard(7),
+    make_start_bitboard(8), make_start_bitboard(9), make_start_bitboard(10), make_start_bitboard(11)
+};
+
+static_assert(START_BITBOARDS[WHITE_KING] == 1ULL << 60 && START_BITBOARDS[BLACK_PAWN] == 0xFF00ULL,
+              "start position is e1 / rank 7 with square 0 = a8");
+
+// one row of the sidecar file, so everything is a byte
+struct position_features {
+    // 0 if the row can't be played -- its FEN didn't parse, or the pieces are no legal placement (see
+    // playable_position). everything else is then 0 too
+    uint8_t valid;
+    // 1 if an earlier valid row has the same pieces on the same squares (the loader's dedupe drops it)
+    uint8_t repeat;
+    uint8_t piece_count;
+    uint8_t type_counts[PIECE_TYPES];
+    // root mean square distance of the pieces from their centre, in tenths of a square
+    uint8_t spread;
+    // percent: how many pieces have a twin mirrored left to right, and the opposite colour's piece mirrored top
+    // to bottom (the way both sides' armies face each other)
+    uint8_t symmetry;
+    // bitboard bits that differ from the starting position
+    uint8_t start_distance;
+    // 0 (trivial) to 100
+    uint8_t difficulty;
+};
+
+static_assert(sizeof(position_features) == 19, "the sidecar format depends on this layout");
+
+position_features compute_features(const unsigned long long* boards) {
+    position_features features = {};
+    features.valid = 1;
+
+    // no two bitboards share a square, so per-type overlaps can be or-ed together and counted once at the end
+    unsigned long long occupied = 0;
+    unsigned long long mirrored_left_right = 0;
+    unsigned long long mirrored_across = 0;
+    unsigned long long home = 0;
+    int kinds = 0;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        unsigned long long bits = boards[type];
+        occupied |= bits;
+        features.type_counts[type] = (uint8_t)popcount64(bits);
+        kinds += bits != 0;
+        mirrored_left_right |= bits & mirror_files(bits);
+        // the same kind of piece of the other colour, mirrored top to bottom (type + 6 and back)
+        mirrored_across |= bits & flip_ranks(boards[(type + PIECE_TYPES / 2) % PIECE_TYPES]);
+        home |= bits & START_BITBOARDS[type];
+    }
+    int pieces = popcount64(occupied);
+    int on_home_squares = popcount64(home);
+    int mirrored = popcount64(mirrored_left_right) + popcount64(mirrored_across);
+    features.piece_count = (uint8_t)pieces;
+    // every piece not on its home square differs, and so does every home square without its piece
+    features.start_distance = (uint8_t)(pieces - on_home_squares + 32 - on_home_squares);
+    if (pieces == 0) {
+        return features;
+    }
+
+    // spread: sum of squares around the centroid, in one pass over the pieces
+    int files = 0, ranks = 0, squares = 0;
+    for (unsigned long long bits = occupied; bits != 0; bits &= bits - 1) {
+        int square = lowest_bit_index(bits);
+        int file = square & 7, rank = square >> 3;
+        files += file;
+        ranks += rank;
+        squares += file * file + rank * rank;
+    }
+    double variance = (double)(squares * pieces - files * files - ranks * ranks) / (pieces * pieces);
+    double spread = sqrt(max(variance, 0.0));
+    features.spread = (uint8_t)min(255.0, round(spread * 10));
+    // every piece can be matched both ways
+    features.symmetry = (uint8_t)(100 * mirrored / (2 * pieces));
+
+    // how many pieces there are to remember is most of it, with the ones still on their home squares counting a
+    // quarter (nobody has to memorize where an unmoved rook is). then how awkward they are: off their home squares,
+    // many different kinds, scattered over the whole board, no symmetry to lean on -- which only starts to matter
+    // once there are a handful of pieces
+    int displaced = pieces - on_home_squares;
+    double load = (displaced + 0.25 * on_home_squares) / 32;
+    double awkwardness = 0.35 * displaced / pieces + 0.25 * kinds / PIECE_TYPES + 0.2 * min(spread / 3.5, 1.0) +
+                         0.2 * (100 - features.symmetry) / 100;
+    double difficulty = 100 * (0.6 * load + 0.4 * awkwardness * min(pieces / 10.0, 1.0));
+    features.difficulty = (uint8_t)min(100.0, round(difficulty));
+    return features;
+}
+
+position_features compute_features(const board_state& board) {
+    unsigned long long boards[PIECE_TYPES];
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        boards[type] = board.get_bitboard((piece_type)type);
+    }
+    return compute_features(boards);
+}
+
+// sidecar feature file written next to the csv: this header, then one position_features per csv data row, in the
+// same order as the rows (every non blank row after the header, whether its FEN parses or not)
+// like the row index it records the csv size and modification time, so features of an older download are ignored
+// it describes the positions the puzzles start from, so it is only used for a mapped csv played from the FEN: the
+// after solution mode replays every row's moves anyway, and packs and compressed downloads are never rescanned
+// version 2 added valid meaning playable, and repeat
+const char FEATURES_MAGIC[4] = {'M', 'C', 'F', 'T'};
+const uint32_t FEATURES_VERSION = 2;
+
+struct features_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t csv_size;
+    int64_t csv_mtime;
+    uint64_t row_count;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+// checks a mapped sidecar file against the csv it should belong to
+inline bool is_valid_features_file(const char* data, size_t size, uint64_t csv_size, int64_t csv_mtime) {
+    features_header header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    return memcmp(header.magic, FEATURES_MAGIC, sizeof(FEATURES_MAGIC)) == 0 && header.version == FEATURES_VERSION &&
+           header.record_size == sizeof(position_features) && header.csv_size == csv_size &&
+           header.csv_mtime == csv_mtime && size == sizeof(header) + header.row_count * sizeof(position_features);
+}
@@ -1,16 +1,702 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <cstdlib>
+#include <cstring>
 #include <ctime> 
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
 #include <vector>
+#include "board_state.cpp"
+#include "compressed_input.cpp"
+#include "frame_profiler.cpp"
+#include "move_generator.cpp"
+#include "packed_position_store.cpp"
+#include "position_features.cpp"
+#include "position_pack.cpp"
+#include "puzzle_index.cpp"
+#include "puzzle_sampler.cpp"
+#include "puzzle_themes.cpp"
+#include "work_stealing_pool.cpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
+// read-only memory mapping of a whole file. the OS pages the file in on demand, so "opening" a multi-GB csv is instant
+// and we never copy the bytes into our own buffers. the mapping is released when the object goes out of scope
+class mapped_file {
+    private:
+
+    const char* mapped_data = nullptr;
+    size_t mapped_size = 0;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping_handle = nullptr;
+#endif
+
+    public:
+
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+        close();
+    }
+
+    bool open(const string& filename) {
+        close();
+#ifdef _WIN32
+        file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file_handle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_handle == nullptr) {
+            close();
+            return false;
+        }
+        mapped_data = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+        if (mapped_data == nullptr) {
+            close();
+            return false;
+        }
+        mapped_size = static_cast<size_t>(file_size.QuadPart);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat file_info;
+        if (fstat(fd, &file_info) != 0 || file_info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* address = mmap(nullptr, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping keeps its own reference to the file, so the descriptor is not needed anymore
+        ::close(fd);
+        if (address == MAP_FAILED) {
+            return false;
+        }
+        // we read the file front to back once when scanning rows, so let the kernel read ahead aggressively
+        madvise(address, file_info.st_size, MADV_SEQUENTIAL);
+        mapped_data = static_cast<const char*>(address);
+        mapped_size = static_cast<size_t>(file_info.st_size);
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (mapped_data != nullptr) UnmapViewOfFile(mapped_data);
+        if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+        mapping_handle = nullptr;
+        file_handle = INVALID_HANDLE_VALUE;
+#else
+        if (mapped_data != nullptr) munmap(const_cast<char*>(mapped_data), mapped_size);
+#endif
+        mapped_data = nullptr;
+        mapped_size = 0;
+    }
+
+    const char* data() const { return mapped_data; }
+    size_t size() const { return mapped_size; }
+    bool is_open() const { return mapped_data != nullptr; }
+};
+
+// returns the given (0 based) column of a csv row, or an empty view if the row is too short
+// the lichess dump never quotes its fields, so a plain comma split is enough
+string_view csv_field(string_view row, uint32_t column) {
+    size_t start = 0;
+    for (uint32_t i = 0; i < column; i++) {
+        size_t comma = row.find(',', start);
+        if (comma == string_view::npos) {
+            return string_view();
+        }
+        start = comma + 1;
+    }
+    size_t end = row.find(',', start);
+    if (end == string_view::npos) {
+        end = row.size();
+    }
+    return row.substr(start, end - start);
+}
+
+// splits a csv row into at most max_fields views and returns how many it found
+// walks the row once, unlike calling csv_field for every column
+int split_csv_row(string_view row, string_view* fields, int max_fields) {
+    int count = 0;
+    size_t start = 0;
+    while (count < max_fields) {
+        size_t end = row.find(',', start);
+        if (end == string_view::npos) {
+            fields[count++] = row.substr(start);
+            break;
+        }
+        fields[count++] = row.substr(start, end - start);
+        start = end + 1;
+    }
+    return count;
+}
+
+// parses an integer column, leaving the fallback value if the column is empty or not a number
+template <typename T>
+T parse_number(string_view field, T fallback) {
+    T value = fallback;
+    from_chars(field.data(), field.data() + field.size(), value);
+    return value;
+}
+
+// lichess csv columns: PuzzleId,FEN,Moves,Rating,RatingDeviation,Popularity,NbPlays,Themes,GameUrl,OpeningTags
+enum csv_column { COLUMN_ID = 0, COLUMN_FEN = 1, COLUMN_MOVES = 2, COLUMN_RATING = 3, COLUMN_POPULARITY = 5,
+                  COLUMN_PLAYS = 6, COLUMN_THEMES = 7, CSV_COLUMNS = 10 };
+
+// the position a split csv row is played from, as 12 bitboards: its FEN's, or with after_solution the one reached
+// by playing the whole Moves column from the FEN. false for a row that can't be played -- a malformed FEN, pieces
+// no real game can have (is_legal_placement), or a move that isn't legal. the plain check costs next to nothing on
+// top of parsing the FEN; replaying the moves is a move generation per move
+bool playable_position(const string_view* fields, bool after_solution, unsigned long long (&position)[PIECE_TYPES]) {
+    if (!after_solution) {
+        return parse_fen_placement(fields[COLUMN_FEN], position) &&
+               is_legal_placement(position, fen_side_to_move(fields[COLUMN_FEN]));
+    }
+    chess_position chess;
+    if (!chess.populate_from_FEN(fields[COLUMN_FEN]) || !chess.is_legal_position() ||
+        !chess.play_uci_moves(fields[COLUMN_MOVES])) {
+        return false;
+    }
+    memcpy(position, chess.get_board().get_bitboards(), sizeof(position));
+    return true;
+}
+
+// calls on_row(offset, row) for every non blank row that starts in [begin, range_end) of a csv buffer, where begin is
+// the start of a row. a row running past range_end is still passed whole, so ranges split on row starts see every
+// row exactly once. on_row returns false to stop the scan early
+// memchr is vectorized in every libc we care about, so this runs at close to memory bandwidth
+template <typename Callback>
+void scan_csv_range(const char* data, size_t size, size_t begin, size_t range_end, Callback on_row) {
+    const char* end = data + size;
+    const char* row = data + begin;
+    while (row < data + range_end) {
+        const char* row_end = static_cast<const char*>(memchr(row, '\n', end - row));
+        if (row_end == nullptr) {
+            row_end = end;
+        }
+        // skip blank lines (including a lone '\r' from windows line endings)
+        if (row_end - row > 1 || (row_end - row == 1 && *row != '\r')) {
+            if (!on_row(static_cast<uint64_t>(row - data), string_view(row, row_end - row))) {
+                return;
+            }
+        }
+        row = row_end + 1;
+    }
+}
+
+// calls on_row(offset, row) for every non blank data row in a csv buffer (the header row is skipped)
+template <typename Callback>
+void scan_csv_rows(const char* data, size_t size, Callback on_row) {
+    const char* header_end = static_cast<const char*>(memchr(data, '\n', size));
+    if (header_end == nullptr) {
+        return;
+    }
+    scan_csv_range(data, size, header_end + 1 - data, size, on_row);
+}
+
+// a csv is cut into chunks of about this many bytes to be scanned on several threads at once
+const size_t CHUNK_BYTES = 4 << 20;
+
+// start of every chunk of about CHUNK_BYTES, each on the start of a row, plus the end of the data at the back
+vector<size_t> chunk_starts(const char* data, size_t size) {
+    vector<size_t> starts;
+    const char* header_end = static_cast<const char*>(memchr(data, '\n', size));
+    size_t start = header_end == nullptr ? size : header_end + 1 - data;
+    while (start < size) {
+        starts.push_back(start);
+        size_t target = start + CHUNK_BYTES;
+        if (target >= size) {
+            break;
+        }
+        const char* row_end = static_cast<const char*>(memchr(data + target, '\n', size - target));
+        start = row_end == nullptr ? size : row_end + 1 - data;
+    }
+    starts.push_back(size);
+    return starts;
+}
+
+// size and modification time of a csv, which the sidecar files (row index, features) are checked against
+bool get_csv_stamp(const string& csv_filename, uint64_t& csv_size, int64_t& csv_mtime) {
+    error_code error;
+    csv_size = filesystem::file_size(csv_filename, error);
+    if (error) {
+        return false;
+    }
+    csv_mtime = filesystem::last_write_time(csv_filename, error).time_since_epoch().count();
+    return !error;
+}
+
+// sidecar row index written next to the csv (lichess_db_puzzle.csv.idx): this header, then one uint64 byte offset per row
+// the csv size and modification time are recorded so an index built for an older download is never trusted
+const char ROW_INDEX_MAGIC[4] = {'M', 'C', 'I', 'X'};
+const uint32_t ROW_INDEX_VERSION = 1;
+
+struct row_index_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t csv_size;
+    int64_t csv_mtime;
+    uint64_t row_count;
+};
+
+// append-only array of row offsets that one loader thread fills while the game reads whatever is there so far
+// values live in fixed size blocks that never move once allocated, and the count is only published (with release
+// ordering) after the value is written, so readers need no lock: anything below size() is safe to read
+class published_offsets {
+    private:
+
+    static constexpr size_t BLOCK_BITS = 16;
+    static constexpr size_t BLOCK_SIZE = size_t(1) << BLOCK_BITS;
+    // 4096 blocks of 65536 rows -- far more than the ~5 million rows lichess has today
+    static constexpr size_t MAX_BLOCKS = 4096;
+
+    unique_ptr<uint64_t[]> blocks[MAX_BLOCKS];
+    atomic<size_t> published{0};
+
+    public:
+
+    // only the loader thread may call this. returns false once we run out of blocks
+    bool push_back(uint64_t value) {
+        size_t index = published.load(memory_order_relaxed);
+        size_t block = index >> BLOCK_BITS;
+        if (block == MAX_BLOCKS) {
+            return false;
+        }
+        if (!blocks[block]) {
+            blocks[block].reset(new uint64_t[BLOCK_SIZE]);
+        }
+        blocks[block][index & (BLOCK_SIZE - 1)] = value;
+        published.store(index + 1, memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return published.load(memory_order_acquire);
+    }
+
+    uint64_t operator[](size_t index) const {
+        return blocks[index >> BLOCK_BITS][index & (BLOCK_SIZE - 1)];
+    }
+
+    // not safe while the loader thread is running
+    void clear() {
+        for (auto& block : blocks) {
+            block.reset();
+        }
+        published.store(0, memory_order_release);
+    }
+};
+
+// set of 64 bit position hashes, used to drop duplicate positions while loading
+// open addressing in one flat array: 8 bytes a slot and no allocation per entry, which matters at millions of rows
+class seen_positions {
+    private:
+
+    // 0 marks an empty slot, so a real hash of 0 (the empty board) is tracked on the side
+    vector<uint64_t> slots;
+    size_t count = 0;
+    bool seen_zero = false;
+
+    // capacity has to be a power of two
+    void rehash(size_t capacity) {
+        vector<uint64_t> old_slots(capacity, 0);
+        old_slots.swap(slots);
+        count = 0;
+        for (uint64_t hash : old_slots) {
+            if (hash != 0) {
+                insert(hash);
+            }
+        }
+    }
+
+    public:
+
+    void reserve(size_t expected) {
+        size_t capacity = 1024;
+        while (capacity * 3 < expected * 4) {
+            capacity *= 2;
+        }
+        if (capacity > slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    // returns false if the hash was already in the set
+    bool insert(uint64_t hash) {
+        if (hash == 0) {
+            bool first = !seen_zero;
+            seen_zero = true;
+            return first;
+        }
+        // keep the table at most 3/4 full so probe runs stay short
+        if ((count + 1) * 4 > slots.size() * 3) {
+            rehash(max<size_t>(1024, slots.size() * 2));
+        }
+        size_t mask = slots.size() - 1;
+        // zobrist hashes are already uniformly random, so the low bits make a fine slot number
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            if (slots[slot] == hash) {
+                return false;
+            }
+            if (slots[slot] == 0) {
+                slots[slot] = hash;
+                count++;
+                return true;
+            }
+        }
+    }
+};
+
 class position_loader {
+    private:
+
+    // mapped mode: the whole csv stays in the mapping and we only remember where each data row starts
+    // that is 8 bytes a row, instead of a string header plus a heap allocation for every FEN
+    // the rows are found by a background thread, so row_offsets grows while the game is already running. finding
+    // them is all it does -- a row is only parsed once it is picked, or by the index build that follows
+    mapped_file csv_mapping;
+    published_offsets row_offsets;
+    // the rows that can be played (and aren't a repeat of an earlier position), in file order, filled in by the
+    // index build. only handed out once index_ready says it is complete
+    vector<uint32_t> playable_rows;
+    thread load_thread;
+    atomic<bool> loading{false};
+    atomic<bool> stop_loading{false};
+    atomic<uint64_t> scanned_bytes{0};
+
+    // rating/popularity/plays/themes of every playable row (or pack record), filled in by the background thread once
+    // the rows are in and only handed out once index_ready says it is complete
+    puzzle_index columns;
+    atomic<bool> index_ready{false};
+
+    // features of every csv row from the csv's .features sidecar, when feature_extractor has made one for this exact
+    // csv. with it the index build takes whether a row is playable, whether it repeats and its difficulty from there
+    // instead of parsing the row's FEN. without it the build works them all out itself
+    mapped_file features_mapping;
+    const position_features* feature_records = nullptr;
+    uint64_t feature_count = 0;
+
+    // pack mode: fixed size records straight out of a mapped position pack
+    mapped_file pack_mapping;
+    const pack_record* pack_records = nullptr;
+    uint32_t pack_count = 0;
+
+    // compressed mode: the rows are streamed out of the compressed download (see compressed_input.cpp) and only their
+    // positions are kept, packed. the store is only handed out once the whole file is in, since it is still growing
+    // (and moving) until then
+    decompressing_reader compressed_input;
+    packed_position_store compressed_positions;
+    atomic<uint32_t> compressed_count{0};
+
+    // indexed mode: nothing but two open files. every lookup is one seek into the index and one seek into the csv,
+    // so memory use stays the same no matter how big the dataset is. that also means nothing is checked or deduped
+    // up front, a row is only found to be unplayable once it is picked
+    ifstream indexed_csv;
+    ifstream row_index;
+    uint64_t indexed_count = 0;
+    string indexed_row;
+    // the two files have one read position each, so reads from different threads take turns (get_indexed_board)
+    mutex indexed_lock;
+
+    // rand() only goes up to 32767 on some platforms, which would never reach most of the millions of rows
+    mt19937_64 random_engine{random_device{}()};
+
+    // picks the next puzzle so that none repeats until every loaded one has been shown
+    puzzle_sampler sampler;
+
+    // drop rows whose position is identical to one we already have (same pieces on the same squares)
+    bool dedupe_positions = true;
+
+    // hand out the position after each puzzle's solution has been played instead of the one it starts from
+    bool after_solution = false;
+
+    static bool read_row_index_header(const string& index_filename, row_index_header& header) {
+        ifstream index(index_filename, ios::binary);
+        if (!index.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            return false;
+        }
+        if (memcmp(header.magic, ROW_INDEX_MAGIC, sizeof(ROW_INDEX_MAGIC)) != 0 || header.version != ROW_INDEX_VERSION) {
+            return false;
+        }
+        // a build that was interrupted leaves a file that is shorter than its header claims
+        error_code error;
+        uint64_t index_size = filesystem::file_size(index_filename, error);
+        return !error && index_size == sizeof(header) + header.row_count * sizeof(uint64_t);
+    }
+
+    // spot check that an index with the right stamp really lines up with the csv, the way a fresh scan would: the
+    // first row starts right after the header line, a handful of rows spread over the file each start right after a
+    // newline, and after the last row there is nothing but blank lines. comparing every offset would be the scan of
+    // the whole csv that the index is there to save
+    static bool check_row_index(const string& csv_filename, const string& index_filename, const row_index_header& header) {
+        ifstream csv(csv_filename, ios::binary);
+        ifstream index(index_filename, ios::binary);
+        string line;
+        if (!getline(csv, line) || header.row_count == 0) {
+            return false;
+        }
+        uint64_t first_row = line.size() + 1;
+        const uint64_t SAMPLES = 16;
+        for (uint64_t sample = 0; sample <= SAMPLES; sample++) {
+            uint64_t row = (header.row_count - 1) * sample / SAMPLES;
+            uint64_t offset = 0;
+            index.seekg(sizeof(row_index_header) + row * sizeof(uint64_t));
+            if (!index.read(reinterpret_cast<char*>(&offset), sizeof(offset)) || offset >= header.csv_size) {
+                return false;
+            }
+            char before = 0;
+            csv.clear();
+            csv.seekg(offset - 1);
+            if ((row == 0 && offset != first_row) || !csv.get(before) || before != '\n') {
+                return false;
+            }
+        }
+        csv.clear();
+        getline(csv, line);
+        while (getline(csv, line)) {
+            if (line.find_first_not_of("\r") != string::npos) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // one pass over the mapped csv, written to a temporary file and renamed into place so readers never see half an index
+    static bool build_row_index(const string& csv_filename, const string& index_filename, uint64_t csv_size, int64_t csv_mtime) {
+        mapped_file csv;
+        if (!csv.open(csv_filename)) {
+            cerr << "Error, we could not map the file: " << csv_filename << endl;
+            return false;
+        }
+
+        string temp_filename = index_filename + ".tmp";
+        ofstream index(temp_filename, ios::binary | ios::trunc);
+        if (!index.is_open()) {
+            cerr << "Error, we could not create the file: " << temp_filename << endl;
+            return false;
+        }
+
+        row_index_header header = {};
+        memcpy(header.magic, ROW_INDEX_MAGIC, sizeof(ROW_INDEX_MAGIC));
+        header.version = ROW_INDEX_VERSION;
+        header.csv_size = csv_size;
+        header.csv_mtime = csv_mtime;
+        index.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        // offsets are written out in blocks rather than one 8 byte write per row
+        vector<uint64_t> block;
+        block.reserve(65536);
+        auto flush_block = [&]() {
+            index.write(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(uint64_t));
+            block.clear();
+        };
+        scan_csv_rows(csv.data(), csv.size(), [&](uint64_t offset, string_view) {
+            block.push_back(offset);
+            header.row_count++;
+            if (block.size() == block.capacity()) {
+                flush_block();
+            }
+            return true;
+        });
+        flush_block();
+
+        index.seekp(0);
+        index.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        index.close();
+        if (!index) {
+            cerr << "Error, failed writing: " << temp_filename << endl;
+            return false;
+        }
+
+        error_code error;
+        filesystem::rename(temp_filename, index_filename, error);
+        if (error) {
+            cerr << "Error, could not replace " << index_filename << ": " << error.message() << endl;
+            return false;
+        }
+        return true;
+    }
+
+    void open_features(const string& csv_filename) {
+        features_mapping.close();
+        feature_records = nullptr;
+        feature_count = 0;
+        uint64_t csv_size;
+        int64_t csv_mtime;
+        string features_filename = csv_filename + ".features";
+        if (!get_csv_stamp(csv_filename, csv_size, csv_mtime) || !features_mapping.open(features_filename)) {
+            return;
+        }
+        if (!is_valid_features_file(features_mapping.data(), features_mapping.size(), csv_size, csv_mtime)) {
+            cerr << "Warning: ignoring " << features_filename << ", it was made for a different csv" << endl;
+            features_mapping.close();
+            return;
+        }
+        feature_records = reinterpret_cast<const position_features*>(features_mapping.data() + sizeof(features_header));
+        feature_count = (features_mapping.size() - sizeof(features_header)) / sizeof(position_features);
+    }
+
+    // stops whatever was loading and maps a csv, ready for scan_row_offsets
+    bool open_mapped(const string& filename) {
+        stop_background_load();
+        compressed_count.store(0);
+        row_offsets.clear();
+        playable_rows.clear();
+        columns = puzzle_index();
+        scanned_bytes.store(0);
+        if (!csv_mapping.open(filename)) {
+            cerr << "Error, we could not map the file: " << filename << endl;
+            return false;
+        }
+        open_features(filename);
+        return true;
+    }
+
+    // finds the start of every data row of the mapped csv. the chunks (see chunk_starts) are scanned on a pool and
+    // published into row_offsets in file order as each one is done, so the first rows can be used while the rest of
+    // the file is still being read. nothing about a row is looked at but where it ends. returns false if it was
+    // stopped or ran out of room before the end
+    bool scan_row_offsets() {
+        const char* data = csv_mapping.data();
+        size_t size = csv_mapping.size();
+        vector<size_t> starts = chunk_starts(data, size);
+        size_t chunks = starts.size() - 1;
+        vector<vector<uint64_t>> chunk_offsets(chunks);
+        vector<bool> chunk_done(chunks, false);
+        mutex done_lock;
+        condition_variable done;
+        // declared after everything its tasks use, so it finishes them before those go away
+        work_stealing_pool pool;
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            pool.submit(chunk, [&, chunk]() {
+                vector<uint64_t>& offsets = chunk_offsets[chunk];
+                offsets.reserve((starts[chunk + 1] - starts[chunk]) / 128);
+                scan_csv_range(data, size, starts[chunk], starts[chunk + 1], [&](uint64_t offset, string_view) {
+                    offsets.push_back(offset);
+                    return !stop_loading.load(memory_order_relaxed);
+                });
+                lock_guard<mutex> guard(done_lock);
+                chunk_done[chunk] = true;
+                done.notify_all();
+            });
+        }
+
+        bool complete = true;
+        for (size_t chunk = 0; chunk < chunks && complete; chunk++) {
+            {
+                unique_lock<mutex> guard(done_lock);
+                done.wait(guard, [&]() { return chunk_done[chunk]; });
+            }
+            for (uint64_t offset : chunk_offsets[chunk]) {
+                if (!row_offsets.push_back(offset)) {
+                    complete = false;
+                    break;
+                }
+            }
+            vector<uint64_t>().swap(chunk_offsets[chunk]);
+            scanned_bytes.store(starts[chunk + 1], memory_order_relaxed);
+            complete = complete && !stop_loading.load(memory_order_relaxed);
+        }
+        pool.wait_idle();
+        scanned_bytes.store(size, memory_order_relaxed);
+        return complete;
+    }
+
+    // second pass over the rows once their offsets are in: drops the ones that can't be played (see
+    // playable_position) and, with dedupe on, repeats of an earlier position, and fills in the query columns of the
+    // rest. all the parsing of a load is here, off the path of anyone waiting for rows -- until it is done,
+    // get_random_board checks each row it picks instead. with the sidecar no FEN is parsed at all, only the columns
+    void build_mapped_index() {
+        PROFILE_SCOPE("index_csv");
+        uint32_t rows = get_mapped_count();
+        // the sidecar is numbered like the rows, and describes the FEN's position, not the one after the solution
+        bool use_sidecar = !after_solution && feature_count == rows;
+        playable_rows.reserve(rows);
+        columns.reserve(rows);
+        seen_positions seen;
+        if (dedupe_positions && !use_sidecar) {
+            seen.reserve(rows);
+        }
+        for (uint32_t row = 0; row < rows; row++) {
+            if (row % 4096 == 0 && stop_loading.load(memory_order_relaxed)) {
+                return;
+            }
+            string_view fields[CSV_COLUMNS];
+            position_features features;
+            if (use_sidecar) {
+                features = feature_records[row];
+                if (!features.valid || (dedupe_positions && features.repeat)) {
+                    continue;
+                }
+                split_csv_row(get_mapped_row(row), fields, CSV_COLUMNS);
+            }
+            else {
+                split_csv_row(get_mapped_row(row), fields, CSV_COLUMNS);
+                unsigned long long position[PIECE_TYPES];
+                if (!playable_position(fields, after_solution, position) ||
+                    (dedupe_positions && !seen.insert(zobrist_hash(position)))) {
+                    continue;
+                }
+                features = compute_features(position);
+            }
+            playable_rows.push_back(row);
+            columns.add(parse_number<uint16_t>(fields[COLUMN_RATING], 0),
+                        parse_number<int>(fields[COLUMN_POPULARITY], 0),
+                        parse_number<uint32_t>(fields[COLUMN_PLAYS], 0),
+                        parse_themes(fields[COLUMN_THEMES]),
+                        features.piece_count,
+                        features.difficulty);
+        }
+        playable_rows.shrink_to_fit();
+        columns.finish();
+        index_ready.store(true, memory_order_release);
+    }
+
     public: 
 
+    position_loader() = default;
+    position_loader(const position_loader&) = delete;
+    position_loader& operator=(const position_loader&) = delete;
+
+    ~position_loader() {
+        stop_background_load();
+    }
+
     // returns a vector of first 100 positions in our dataset in FEN format
     vector<string> load_position(const string& filename) {
         vector<string> positions;
@@ -35,15 +721,454 @@ class position_loader {
         return positions;
     }
 
+    // maps the csv and starts finding its rows on a background thread, then returns straight away
+    // positions can be used as soon as get_mapped_count() is above zero; the rest keep streaming in behind them. once
+    // every row is in, the same thread goes on to build the index (see build_mapped_index)
+    bool start_mapped_load(const string& filename) {
+        if (!open_mapped(filename)) {
+            return false;
+        }
+        loading.store(true);
+        load_thread = thread([this]() {
+            PROFILE_SCOPE("load_csv");
+            bool complete = scan_row_offsets();
+            loading.store(false, memory_order_release);
+            if (complete) {
+                build_mapped_index();
+            }
+        });
+        return true;
+    }
+
+    // starts streaming the positions out of a .csv.zst / .csv.gz (or plain csv) on a background thread and returns
+    // straight away. unlike the mapped csv nothing can be played until the whole file is in -- positions are
+    // available once is_loading() goes false -- but the decompressed csv never has to exist on disk or in memory:
+    // the load keeps about 21 bytes per position plus a few megabytes of buffers however big the file is
+    bool start_compressed_load(const string& filename) {
+        stop_background_load();
+        csv_mapping.close();
+        row_offsets.clear();
+        columns = puzzle_index();
+        playable_rows.clear();
+        compressed_positions = packed_position_store();
+        compressed_count.store(0);
+        scanned_bytes.store(0);
+        if (!compressed_input.open(filename)) {
+            return false;
+        }
+
+        loading.store(true);
+        load_thread = thread([this, filename]() {
+            PROFILE_SCOPE("load_compressed");
+            seen_positions seen;
+            board_state board;
+            uint64_t rows = 0;
+            bool complete = stream_csv_rows(compressed_input, [&](string_view row) {
+                string_view fields[CSV_COLUMNS];
+                split_csv_row(row, fields, CSV_COLUMNS);
+                unsigned long long position[PIECE_TYPES];
+                if (playable_position(fields, after_solution, position) &&
+                    (!dedupe_positions || seen.insert(zobrist_hash(position)))) {
+                    board.set_bitboards(position);
+                    if (compressed_positions.add(board)) {
+                        columns.add(parse_number<uint16_t>(fields[COLUMN_RATING], 0),
+                                    parse_number<int>(fields[COLUMN_POPULARITY], 0),
+                                    parse_number<uint32_t>(fields[COLUMN_PLAYS], 0),
+                                    parse_themes(fields[COLUMN_THEMES]),
+                                    (uint8_t)popcount64(board.occupancy()),
+                                    compute_features(position).difficulty);
+                    }
+                }
+                if (++rows % 4096 == 0) {
+                    scanned_bytes.store(compressed_input.bytes_read(), memory_order_relaxed);
+                }
+                return !stop_loading.load(memory_order_relaxed);
+            });
+            if (!complete) {
+                cerr << "Error, " << filename << " is corrupt or cut short, keeping the positions before that" << endl;
+            }
+            compressed_positions.shrink_to_fit();
+            scanned_bytes.store(compressed_input.size(), memory_order_relaxed);
+            if (!stop_loading.load(memory_order_relaxed)) {
+                columns.finish();
+                compressed_count.store((uint32_t)compressed_positions.size(), memory_order_release);
+                index_ready.store(true, memory_order_release);
+            }
+            loading.store(false, memory_order_release);
+        });
+        return true;
+    }
+
+    // whether the next load drops duplicate positions (on by default). costs about 10 bytes per row while loading
+    void set_dedupe(bool enabled) {
+        dedupe_positions = enabled;
+    }
+
+    // whether csv rows are played from the position after their solution (the whole Moves column) instead of the
+    // puzzle's FEN. takes effect from the next load, which then also drops the rows whose moves don't replay. packs
+    // only have the FEN's position, so they aren't affected
+    void set_after_solution(bool enabled) {
+        after_solution = enabled;
+    }
+
+    bool is_after_solution() const {
+        return after_solution;
+    }
+
+    // the board a csv row is played from, empty if it can't be played (see playable_position)
+    board_state get_row_board(string_view row) const {
+        string_view fields[CSV_COLUMNS];
+        split_csv_row(row, fields, CSV_COLUMNS);
+        unsigned long long position[PIECE_TYPES];
+        board_state board;
+        if (playable_position(fields, after_solution, position)) {
+            board.set_bitboards(position);
+        }
+        return board;
+    }
+
+    // maps the whole csv into memory and records the start of every data row. returns false if nothing could be loaded
+    // unlike load_position this keeps every row in the file, and the FENs are handed out as views into the mapping
+    // only finding the rows blocks; the index is built on a background thread afterwards, unless build_index is
+    // false because the caller only wants the rows themselves
+    bool load_position_mapped(const string& filename, bool build_index = true) {
+        if (!open_mapped(filename)) {
+            return false;
+        }
+        loading.store(true);
+        scan_row_offsets();
+        loading.store(false, memory_order_release);
+        if (row_offsets.size() == 0) {
+            cerr << "Error, no data rows in: " << filename << endl;
+            csv_mapping.close();
+            return false;
+        }
+        if (build_index) {
+            load_thread = thread([this]() {
+                build_mapped_index();
+            });
+        }
+        return true;
+    }
+
+    void wait_for_load() {
+        if (load_thread.joinable()) {
+            load_thread.join();
+        }
+    }
+
+    // stops the background thread (row scan or index build) and throws away the unfinished index
+    void stop_background_load() {
+        stop_loading.store(true);
+        wait_for_load();
+        stop_loading.store(false);
+        index_ready.store(false);
+    }
+
+    bool is_loading() const {
+        return loading.load(memory_order_acquire);
+    }
+
+    // fraction of the csv scanned for rows so far, 0 to 1
+    float get_load_progress() const {
+        uint64_t total = csv_mapping.size() > 0 ? csv_mapping.size() : compressed_input.size();
+        if (total == 0) {
+            return 0.0f;
+        }
+        return (float)scanned_bytes.load(memory_order_relaxed) / total;
+    }
+
+    // the full csv row at the given index, without the trailing newline
+    string_view get_mapped_row(uint32_t index) const {
+        const char* data = csv_mapping.data();
+        const char* row = data + row_offsets[index];
+        const char* end = data + csv_mapping.size();
+        const char* row_end = static_cast<const char*>(memchr(row, '\n', end - row));
+        if (row_end == nullptr) {
+            row_end = end;
+        }
+        if (row_end > row && row_end[-1] == '\r') {
+            row_end--;
+        }
+        return string_view(row, row_end - row);
+    }
+
+    // FEN column of the given row. the view stays valid for as long as the loader is alive
+    string_view get_mapped_position(uint32_t index) const {
+        return csv_field(get_mapped_row(index), 1);
+    }
+
+    // the board the given row is played from, which after_solution says
+    board_state get_mapped_board(uint32_t index) const {
+        return get_row_board(get_mapped_row(index));
+    }
+
+    string_view get_random_mapped_position() {
+        size_t count = row_offsets.size();
+        if (count == 0) {
+            cerr << "Warning: no positions are currently loaded.";
+            return string_view();
+        }
+        return get_mapped_position(static_cast<uint32_t>(sampler.next(count)));
+    }
+
+    uint32_t get_mapped_count() const {
+        return static_cast<uint32_t>(row_offsets.size());
+    }
+
+    // opens the csv for random access through its sidecar row index, building (or rebuilding) the index first if it
+    // is missing or was made for a different version of the csv. returns false if no rows could be indexed
+    bool open_indexed(const string& csv_filename) {
+        indexed_csv.close();
+        row_index.close();
+        indexed_count = 0;
+
+        uint64_t csv_size;
+        int64_t csv_mtime;
+        if (!get_csv_stamp(csv_filename, csv_size, csv_mtime)) {
+            cerr << "Error, we could not open the file: " << csv_filename << endl;
+            return false;
+        }
+
+        string index_filename = csv_filename + ".idx";
+        row_index_header header;
+        if (!read_row_index_header(index_filename, header) || header.csv_size != csv_size || header.csv_mtime != csv_mtime ||
+            !check_row_index(csv_filename, index_filename, header)) {
+            cout << "Building row index for " << csv_filename << "..." << endl;
+            if (!build_row_index(csv_filename, index_filename, csv_size, csv_mtime) ||
+                !read_row_index_header(index_filename, header)) {
+                return false;
+            }
+        }
+
+        indexed_csv.open(csv_filename, ios::binary);
+        row_index.open(index_filename, ios::binary);
+        if (!indexed_csv.is_open() || !row_index.is_open() || header.row_count == 0) {
+            cerr << "Error, no data rows in: " << csv_filename << endl;
+            indexed_csv.close();
+            row_index.close();
+            return false;
+        }
+        indexed_count = header.row_count;
+        return true;
+    }
+
+    // reads one row through the index. the view points into a buffer that is reused by the next call, so this is
+    // for one thread only -- get_indexed_board can be called from any
+    string_view get_indexed_row(uint64_t index) {
+        uint64_t offset = 0;
+        row_index.clear();
+        row_index.seekg(sizeof(row_index_header) + index * sizeof(uint64_t));
+        row_index.read(reinterpret_cast<char*>(&offset), sizeof(offset));
+
+        indexed_csv.clear();
+        indexed_csv.seekg(offset);
+        if (!row_index || !getline(indexed_csv, indexed_row)) {
+            cerr << "Warning: could not read row " << index << " through the index." << endl;
+            return string_view();
+        }
+        if (!indexed_row.empty() && indexed_row.back() == '\r') {
+            indexed_row.pop_back();
+        }
+        return indexed_row;
+    }
+
+    // the board the given row is played from, empty if it can't be played (see playable_position)
+    board_state get_indexed_board(uint64_t index) {
+        lock_guard<mutex> guard(indexed_lock);
+        return get_row_board(get_indexed_row(index));
+    }
+
+    string_view get_indexed_position(uint64_t index) {
+        return csv_field(get_indexed_row(index), 1);
+    }
+
+    string_view get_random_indexed_position() {
+        if (indexed_count == 0) {
+            cerr << "Warning: no positions are currently loaded.";
+            return string_view();
+        }
+        return get_indexed_position(sampler.next(indexed_count));
+    }
+
+    uint64_t get_indexed_count() const {
+        return indexed_count;
+    }
+
+    // maps a position pack written by pack_converter. returns false (quietly) if the file doesn't exist
+    // opening is O(1): we only check the header, unless verify_checksum asks us to read every record once
+    bool open_position_pack(const string& filename, bool verify_checksum = false) {
+        stop_background_load();
+        pack_records = nullptr;
+        pack_count = 0;
+        playable_rows.clear();
+        if (!pack_mapping.open(filename)) {
+            return false;
+        }
+
+        const char* data = pack_mapping.data();
+        size_t size = pack_mapping.size();
+        pack_header header;
+        if (size < sizeof(header)) {
+            cerr << "Error, position pack is truncated: " << filename << endl;
+            pack_mapping.close();
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+
+        if (memcmp(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 || header.version != PACK_VERSION ||
+            header.record_size != sizeof(pack_record)) {
+            cerr << "Error, not a version " << PACK_VERSION << " position pack: " << filename << endl;
+            pack_mapping.close();
+            return false;
+        }
+        if (header.record_count == 0 || size != sizeof(header) + (size_t)header.record_count * sizeof(pack_record)) {
+            cerr << "Error, position pack size does not match its header: " << filename << endl;
+            pack_mapping.close();
+            return false;
+        }
+        if (verify_checksum && pack_checksum(data + sizeof(header), size - sizeof(header)) != header.checksum) {
+            cerr << "Error, position pack checksum mismatch: " << filename << endl;
+            pack_mapping.close();
+            return false;
+        }
+
+        // the header is 24 bytes and the mapping is page aligned, so the records are 8 byte aligned
+        pack_records = reinterpret_cast<const pack_record*>(data + sizeof(header));
+        pack_count = header.record_count;
+
+        // the records already carry every column but the difficulty, which comes from their pieces, so the query index
+        // is just a quick pass over them in the background
+        columns = puzzle_index();
+        load_thread = thread([this]() {
+            columns.reserve(pack_count);
+            board_state board;
+            for (uint32_t i = 0; i < pack_count; i++) {
+                if (i % 4096 == 0 && stop_loading.load(memory_order_relaxed)) {
+                    return;
+                }
+                const pack_record& record = pack_records[i];
+                board.set_packed_pieces(record.occupancy, record.pieces);
+                columns.add(record.rating, record.popularity, record.nb_plays, record.themes,
+                            (uint8_t)popcount64(record.occupancy), compute_features(board).difficulty);
+            }
+            columns.finish();
+            index_ready.store(true, memory_order_release);
+        });
+        return true;
+    }
+
+    const pack_record& get_pack_record(uint32_t index) const {
+        return pack_records[index];
+    }
+
+    board_state get_pack_position(uint32_t index) const {
+        return unpack_board(pack_records[index]);
+    }
+
+    uint32_t get_pack_count() const {
+        return pack_count;
+    }
+
+    // only valid once a compressed load has finished (get_compressed_count() above zero)
+    board_state get_compressed_position(uint32_t index) const {
+        return compressed_positions.get(index);
+    }
+
+    uint32_t get_compressed_count() const {
+        return compressed_count.load(memory_order_acquire);
+    }
+
+    // how many positions can be handed out right now, from whichever source is open
+    uint64_t get_available_count() const {
+        if (pack_count > 0) return pack_count;
+        if (compressed_count.load(memory_order_acquire) > 0) return compressed_count.load(memory_order_relaxed);
+        if (indexed_count > 0) return indexed_count;
+        return is_index_ready() ? playable_rows.size() : row_offsets.size();
+    }
+
+    // true once the columns of every row are in and filtered queries can be answered
+    // (the sidecar index mode never builds one, since it is meant to use no memory per row)
+    bool is_index_ready() const {
+        return index_ready.load(memory_order_acquire);
+    }
+
+    // only valid once is_index_ready() is true
+    const puzzle_index& get_puzzle_index() const {
+        return columns;
+    }
+
+    // random row (csv row or pack record) matching the query, or -1 if nothing matches or the index isn't ready yet
+    int64_t find_random_match(const puzzle_query& query) {
+        if (!is_index_ready()) {
+            return -1;
+        }
+        int64_t match = columns.find_random(query, random_engine);
+        // for a csv the columns only cover the playable rows
+        if (match >= 0 && !playable_rows.empty()) {
+            match = playable_rows[match];
+        }
+        return match;
+    }
+
+    // fills board with a random position matching the query. returns false (leaving board alone) if there is none
+    bool get_random_matching_board(const puzzle_query& query, board_state& board) {
+        int64_t row = find_random_match(query);
+        if (row < 0) {
+            return false;
+        }
+        if (pack_count > 0) {
+            board = get_pack_position((uint32_t)row);
+        }
+        else if (compressed_count.load(memory_order_acquire) > 0) {
+            compressed_positions.get((size_t)row, board);
+        }
+        else {
+            board = get_mapped_board((uint32_t)row);
+        }
+        return true;
+    }
+
+    // random board from whichever source is open, preferring the pack since it needs no parsing
+    // no board repeats until every available one has been handed out
+    board_state get_random_board() {
+        board_state board;
+        if (pack_count > 0) {
+            board = get_pack_position((uint32_t)sampler.next(pack_count));
+        }
+        else if (compressed_count.load(memory_order_acquire) > 0) {
+            compressed_positions.get(sampler.next(compressed_count.load(memory_order_relaxed)), board);
+        }
+        else if (indexed_count > 0) {
+            // rows are only checked when they are read, so skip the ones that turn out not to be playable
+            for (int tries = 0; tries < 64 && board.occupancy() == 0; tries++) {
+                board = get_indexed_board(sampler.next(indexed_count));
+            }
+        }
+        else if (is_index_ready() && !playable_rows.empty()) {
+            board = get_mapped_board(playable_rows[sampler.next(playable_rows.size())]);
+        }
+        else if (row_offsets.size() > 0) {
+            // nothing has been checked yet, so skip the rows that turn out not to be playable
+            for (int tries = 0; tries < 64 && board.occupancy() == 0; tries++) {
+                board = get_mapped_board((uint32_t)sampler.next(row_offsets.size()));
+            }
+        }
+        else {
+            cerr << "Warning: no positions are currently loaded.";
+        }
+        return board;
+    }
+
     string get_random_position(const vector<string>& positions) {
         if (positions.empty()) {
             cerr << "Warning: no positions are currently loaded.";
             return "";
         }
         else {
-            // be sure to include this line at start of program: srand(time(0));
-            uint32_t index = rand() % positions.size();
-            return positions[index];
+            // rand() % size favours the low indices, a distribution over the exact range doesn't
+            uniform_int_distribution<size_t> pick(0, positions.size() - 1);
+            return positions[pick(random_engine)];
         }
     }
 
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include "board_state.cpp"
+#include "puzzle_themes.cpp"
+
+using namespace std;
+
+// binary "position pack" -- the lichess csv converted offline (see pack_converter.cpp) into fixed size records
+// so the game can memory map it and build a board_state without parsing any text
+//
+// file layout: [pack_header][pack_record * record_count], little endian, no padding between records
+
+const char PACK_MAGIC[4] = {'M', 'C', 'P', 'K'};
+// version 2 made room for 128 themes (the 64 bit mask of version 1 was already full)
+const uint32_t PACK_VERSION = 2;
+
+struct pack_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t record_count;
+    // FNV-1a over all the record bytes that follow the header
+    uint64_t checksum;
+};
+
+struct pack_record {
+    // one bit per occupied square, same square numbering as board_state (0 = a8, 63 = h1)
+    uint64_t occupancy;
+    // 4 bit piece code (piece_type) for every occupied square, in square order, two per byte (low nibble first)
+    // a legal position has at most 32 pieces, so 16 bytes always fit
+    uint8_t pieces[16];
+    // PUZZLE_THEMES the puzzle is tagged with
+    theme_set themes;
+    // lichess puzzle id, zero padded (they are 5 characters today)
+    char puzzle_id[8];
+    uint16_t rating;
+    int16_t popularity;
+    uint32_t nb_plays;
+};
+
+static_assert(sizeof(pack_header) == 24, "pack header layout changed");
+static_assert(sizeof(pack_record) == 56, "pack record layout changed");
+
+// FNV-1a, 64 bit. call it repeatedly with the previous result to checksum data in pieces
+uint64_t pack_checksum(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// writes a 4 bit piece code (piece_type) for every occupied square of the board, in square order, two per byte
+// (low nibble first). pieces has to be zeroed and have room for (pieces on the board + 1) / 2 bytes
+// shared by the pack records and packed_position_store, which store pieces the same way
+// (board_state::set_packed_pieces reads them back)
+void pack_pieces(const board_state& board, uint8_t* pieces) {
+    int count = 0;
+    for (uint64_t occupied = board.occupancy(); occupied != 0; occupied &= occupied - 1) {
+        int square = lowest_bit_index(occupied);
+        pieces[count / 2] |= piece_type_of(board.get_piece_at(square)) << ((count % 2) * 4);
+        count++;
+    }
+}
+
+// fills the occupancy and piece nibbles of a record. returns false if the board has more than 32 pieces
+bool pack_board(const board_state& board, pack_record& record) {
+    record.occupancy = board.occupancy();
+    memset(record.pieces, 0, sizeof(record.pieces));
+    if (popcount64(record.occupancy) > 32) {
+        return false;
+    }
+    pack_pieces(board, record.pieces);
+    return true;
+}
+
+// rebuilds the board from a record -- just walks the occupied squares, no text involved
+board_state unpack_board(const pack_record& record) {
+    board_state board;
+    board.set_packed_pieces(record.occupancy, record.pieces);
+    return board;
+}
+
+string_view pack_puzzle_id(const pack_record& record) {
+    return string_view(record.puzzle_id, strnlen(record.puzzle_id, sizeof(record.puzzle_id)));
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "bitboard_utils.cpp"
+#include "puzzle_themes.cpp"
+
+using namespace std;
+
+// filter for picking a puzzle, e.g. rating 1400-1700, theme endgame, at most 10 pieces, difficulty 30-60
+// every field defaults to "anything goes"
+struct puzzle_query {
+    uint16_t min_rating = 0;
+    uint16_t max_rating = UINT16_MAX;
+    // index into PUZZLE_THEMES (see find_theme), -1 for any theme
+    int theme = -1;
+    uint8_t max_pieces = 64;
+    int8_t min_popularity = -100;
+    uint32_t min_plays = 0;
+    // position_features::difficulty, 0-100
+    uint8_t min_difficulty = 0;
+    uint8_t max_difficulty = UINT8_MAX;
+};
+
+// the numeric lichess columns of every row, stored column by column so a query only touches the columns it filters on
+// row numbers match the order rows were added in, which is the order the loader hands positions out
+class puzzle_index {
+    private:
+
+    vector<uint16_t> ratings;
+    vector<int8_t> popularity;
+    vector<uint32_t> nb_plays;
+    vector<uint8_t> piece_counts;
+    vector<uint8_t> difficulties;
+
+    // one bitmap per theme, bit r set if row r has that theme
+    vector<uint64_t> theme_bits[PUZZLE_THEME_COUNT];
+    uint32_t theme_counts[PUZZLE_THEME_COUNT] = {};
+
+    // row numbers sorted by rating, so a rating range is a contiguous slice found with two binary searches
+    vector<uint32_t> by_rating;
+
+    bool matches(uint32_t row, const puzzle_query& query) const {
+        return ratings[row] >= query.min_rating && ratings[row] <= query.max_rating &&
+               piece_counts[row] <= query.max_pieces &&
+               popularity[row] >= query.min_popularity &&
+               nb_plays[row] >= query.min_plays &&
+               difficulties[row] >= query.min_difficulty && difficulties[row] <= query.max_difficulty &&
+               (query.theme < 0 || ((theme_bits[query.theme][row / 64] >> (row % 64)) & 1ULL));
+    }
+
+    public:
+
+    void reserve(size_t rows) {
+        ratings.reserve(rows);
+        popularity.reserve(rows);
+        nb_plays.reserve(rows);
+        piece_counts.reserve(rows);
+        difficulties.reserve(rows);
+    }
+
+    void add(uint16_t rating, int popularity_score, uint32_t plays, const theme_set& themes, uint8_t pieces,
+             uint8_t difficulty) {
+        uint32_t row = static_cast<uint32_t>(ratings.size());
+        if (row % 64 == 0) {
+            for (auto& bits : theme_bits) {
+                bits.push_back(0);
+            }
+        }
+        ratings.push_back(rating);
+        popularity.push_back(static_cast<int8_t>(max(-100, min(100, popularity_score))));
+        nb_plays.push_back(plays);
+        piece_counts.push_back(pieces);
+        difficulties.push_back(difficulty);
+        for (int word = 0; word < MAX_PUZZLE_THEMES / 64; word++) {
+            for (uint64_t bits = themes.words[word]; bits != 0; bits &= bits - 1) {
+                int theme = word * 64 + lowest_bit_index(bits);
+                theme_bits[theme][row / 64] |= (1ULL << (row % 64));
+                theme_counts[theme]++;
+            }
+        }
+    }
+
+    // call once every row has been added, before the first query
+    void finish() {
+        // ratings are small integers, so a counting sort beats sort() by a wide margin on millions of rows
+        vector<uint32_t> starts(UINT16_MAX + 2, 0);
+        for (uint16_t rating : ratings) {
+            starts[rating + 1]++;
+        }
+        for (size_t i = 1; i < starts.size(); i++) {
+            starts[i] += starts[i - 1];
+        }
+        by_rating.resize(ratings.size());
+        for (uint32_t row = 0; row < ratings.size(); row++) {
+            by_rating[starts[ratings[row]]++] = row;
+        }
+    }
+
+    size_t size() const {
+        return ratings.size();
+    }
+
+    uint16_t get_rating(uint32_t row) const { return ratings[row]; }
+    int8_t get_popularity(uint32_t row) const { return popularity[row]; }
+    uint32_t get_plays(uint32_t row) const { return nb_plays[row]; }
+    uint8_t get_piece_count(uint32_t row) const { return piece_counts[row]; }
+    uint8_t get_difficulty(uint32_t row) const { return difficulties[row]; }
+
+    // returns a uniformly random row that matches the query, or -1 if there is none
+    int64_t find_random(const puzzle_query& query, mt19937_64& random_engine) const {
+        if (query.min_rating > query.max_rating) {
+            return -1;
+        }
+        auto rating_less = [this](uint32_t row, uint16_t rating) { return ratings[row] < rating; };
+        auto rating_greater = [this](uint16_t rating, uint32_t row) { return rating < ratings[row]; };
+        size_t low = lower_bound(by_rating.begin(), by_rating.end(), query.min_rating, rating_less) - by_rating.begin();
+        size_t high = upper_bound(by_rating.begin(), by_rating.end(), query.max_rating, rating_greater) - by_rating.begin();
+        if (low >= high) {
+            return -1;
+        }
+
+        // most queries match a decent share of their rating slice, so a handful of random probes almost always hits
+        uniform_int_distribution<size_t> pick(low, high - 1);
+        for (int attempt = 0; attempt < 32; attempt++) {
+            uint32_t row = by_rating[pick(random_engine)];
+            if (matches(row, query)) {
+                return row;
+            }
+        }
+
+        // rare combination: reservoir sample over every match, walking whichever candidate set is smaller --
+        // the rating slice, or the theme bitmap a word at a time (which skips 64 rows per empty word)
+        int64_t chosen = -1;
+        uint64_t seen = 0;
+        auto consider = [&](uint32_t row) {
+            if (!matches(row, query)) return;
+            seen++;
+            if (uniform_int_distribution<uint64_t>(0, seen - 1)(random_engine) == 0) {
+                chosen = row;
+            }
+        };
+        if (query.theme >= 0 && theme_counts[query.theme] < high - low) {
+            const vector<uint64_t>& bits = theme_bits[query.theme];
+            for (size_t word = 0; word < bits.size(); word++) {
+                uint64_t set = bits[word];
+                while (set != 0) {
+                    consider(static_cast<uint32_t>(word * 64 + lowest_bit_index(set)));
+                    set &= set - 1;
+                }
+            }
+        }
+        else {
+            for (size_t i = low; i < high; i++) {
+                consider(by_rating[i]);
+            }
+        }
+        return chosen;
+    }
+};
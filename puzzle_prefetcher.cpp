@@ -0,0 +1,113 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "board_state.cpp"
+#include "memory_chess_core.cpp"
+
+using namespace std;
+
+// keeps the next puzzle picked and parsed on a background thread, so starting a new one never waits on the loader
+// there is always at most one puzzle waiting. take() hands it over and the thread immediately goes off to get the
+// one after it. every puzzle gets a generation number, so a front end that pre-renders the waiting puzzle (peek)
+// can tell whether what it rendered is the one it was just handed (take)
+//
+// the source is only ever called from the background thread, so it doesn't need to be safe to call from two threads
+// at once as long as nothing else calls it
+class puzzle_prefetcher {
+    private:
+
+    puzzle_source source;
+
+    mutable mutex lock;
+    // wakes the background thread when the waiting puzzle has been taken
+    condition_variable taken;
+    // wakes take() when a puzzle is ready, or the source turned out to be empty
+    condition_variable ready_or_empty;
+
+    unique_ptr<board_state> waiting;
+    uint64_t waiting_generation = 0;
+    uint64_t next_generation = 1;
+    // the last call to the source came back empty (positions still loading); cleared on the next try
+    bool source_empty = false;
+    bool stopping = false;
+
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            taken.wait(guard, [this]() { return stopping || waiting == nullptr; });
+            if (stopping) break;
+
+            guard.unlock();
+            auto next = make_unique<board_state>();
+            bool found = source(*next);
+            guard.lock();
+
+            if (found) {
+                waiting = move(next);
+                waiting_generation = next_generation++;
+                source_empty = false;
+                ready_or_empty.notify_all();
+            }
+            else {
+                // nothing to hand out yet, try again shortly
+                source_empty = true;
+                ready_or_empty.notify_all();
+                taken.wait_for(guard, chrono::milliseconds(100), [this]() { return stopping; });
+            }
+        }
+    }
+
+    public:
+
+    explicit puzzle_prefetcher(puzzle_source puzzle_source_function) : source(move(puzzle_source_function)) {
+        worker = thread([this]() { run(); });
+    }
+
+    ~puzzle_prefetcher() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        taken.notify_all();
+        worker.join();
+    }
+
+    puzzle_prefetcher(const puzzle_prefetcher&) = delete;
+    puzzle_prefetcher& operator=(const puzzle_prefetcher&) = delete;
+
+    // hands over the waiting puzzle and its generation. if it isn't ready yet this waits for the one being fetched
+    // right now; returns false straight away if the source has nothing to give
+    bool take(board_state& puzzle, uint64_t* generation = nullptr) {
+        unique_lock<mutex> guard(lock);
+        ready_or_empty.wait(guard, [this]() { return waiting != nullptr || source_empty || stopping; });
+        if (waiting == nullptr) {
+            return false;
+        }
+        puzzle = *waiting;
+        if (generation != nullptr) {
+            *generation = waiting_generation;
+        }
+        waiting.reset();
+        guard.unlock();
+        taken.notify_one();
+        return true;
+    }
+
+    // copy of the waiting puzzle without taking it, false if none is waiting yet
+    bool peek(board_state& puzzle, uint64_t& generation) const {
+        lock_guard<mutex> guard(lock);
+        if (waiting == nullptr) {
+            return false;
+        }
+        puzzle = *waiting;
+        generation = waiting_generation;
+        return true;
+    }
+};
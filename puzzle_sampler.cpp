@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+
+using namespace std;
+
+// hands out puzzle numbers in [0, count) in a random order without repeating one until all of them have been used
+//
+// shuffling a list of millions of indices would cost 4-8 bytes per puzzle, so instead the order is a keyed Feistel
+// network: a bijection on [0, 2^bits) that we walk with a plain counter. values that land outside [0, count) are fed
+// through again ("cycle walking") until they land inside, which keeps it a bijection on [0, count). the domain is at
+// most 4x count, so that takes under four rounds on average. memory use is a few words no matter how many puzzles
+class puzzle_sampler {
+    private:
+
+    static const int ROUNDS = 4;
+
+    uint64_t domain = 0;
+    uint64_t drawn = 0;
+    int half_bits = 0;
+    uint64_t round_keys[ROUNDS] = {};
+    mt19937_64 random_engine{random_device{}()};
+
+    uint64_t round_function(uint64_t half, uint64_t key) const {
+        uint64_t x = (half ^ key) * 0x9E3779B97F4A7C15ULL;
+        x ^= x >> 29;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        return x ^ (x >> 32);
+    }
+
+    uint64_t feistel(uint64_t value) const {
+        uint64_t mask = (1ULL << half_bits) - 1;
+        uint64_t left = value >> half_bits;
+        uint64_t right = value & mask;
+        for (uint64_t key : round_keys) {
+            uint64_t next = left ^ (round_function(right, key) & mask);
+            left = right;
+            right = next;
+        }
+        return (left << half_bits) | right;
+    }
+
+    // new order over [0, count)
+    void start_round(uint64_t count) {
+        domain = count;
+        drawn = 0;
+        int bits = 1;
+        while ((1ULL << bits) < count) {
+            bits++;
+        }
+        half_bits = (bits + 1) / 2;
+        for (uint64_t& key : round_keys) {
+            key = random_engine();
+        }
+    }
+
+    public:
+
+    // next puzzle number out of count. count may grow between calls (positions still loading in the background):
+    // new puzzles join at the start of the next round, or straight away if the pool has at least doubled since the
+    // round started, so a round that began with a handful of positions doesn't hold the rest back for long
+    uint64_t next(uint64_t count) {
+        if (count == 0) {
+            return 0;
+        }
+        if (drawn >= domain || count < domain || count >= 2 * domain) {
+            start_round(count);
+        }
+        uint64_t value = drawn++;
+        do {
+            value = feistel(value);
+        } while (value >= domain);
+        return value;
+    }
+
+    // how many puzzles are left before the current round starts repeating
+    uint64_t remaining() const {
+        return domain - drawn;
+    }
+};
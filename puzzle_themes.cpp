@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+
+using namespace std;
+
+// every theme tag lichess puts in the Themes column, in a fixed order so that each one owns a bit of a theme_set
+// the order is part of the position pack format, so only ever append to this list
+const char* const PUZZLE_THEMES[] = {
+    "advancedPawn", "advantage", "anastasiaMate", "arabianMate", "attackingF2F7", "attraction",
+    "backRankMate", "bishopEndgame", "bodenMate", "capturingDefender", "castling", "clearance",
+    "crushing", "defensiveMove", "deflection", "discoveredAttack", "doubleBishopMate", "doubleCheck",
+    "dovetailMate", "enPassant", "endgame", "equality", "exposedKing", "fork",
+    "hangingPiece", "hookMate", "interference", "intermezzo", "kingsideAttack", "knightEndgame",
+    "long", "master", "masterVsMaster", "mate", "mateIn1", "mateIn2",
+    "mateIn3", "mateIn4", "mateIn5", "middlegame", "oneMove", "opening",
+    "pawnEndgame", "pin", "promotion", "queenEndgame", "queenRookEndgame", "queensideAttack",
+    "quietMove", "rookEndgame", "sacrifice", "short", "skewer", "smotheredMate",
+    "superGM", "trappedPiece", "underPromotion", "veryLong", "xRayAttack", "zugzwang",
+    "killBoxMate", "vukovicMate", "cornerMate", "triangleMate"
+};
+
+const int PUZZLE_THEME_COUNT = sizeof(PUZZLE_THEMES) / sizeof(PUZZLE_THEMES[0]);
+
+// how many themes a theme_set (and so a pack record) has room for. the list above already fills the first 64, new
+// tags go in the second word. going past this means a new pack version
+const int MAX_PUZZLE_THEMES = 128;
+
+static_assert(PUZZLE_THEME_COUNT <= MAX_PUZZLE_THEMES, "puzzle themes have to fit in a theme_set");
+
+// bit set of PUZZLE_THEMES, theme t is bit t % 64 of words[t / 64]
+struct theme_set {
+    uint64_t words[MAX_PUZZLE_THEMES / 64] = {};
+
+    void add(int theme) {
+        words[theme / 64] |= (1ULL << (theme % 64));
+    }
+
+    bool has(int theme) const {
+        return (words[theme / 64] >> (theme % 64)) & 1ULL;
+    }
+};
+
+// returns the bit index of a theme name, or -1 if we don't know it
+// this runs for every tag of every row while loading, so it is a hash lookup rather than a walk over the list
+int find_theme(string_view name) {
+    static const unordered_map<string_view, int> theme_numbers = []() {
+        unordered_map<string_view, int> numbers;
+        for (int i = 0; i < PUZZLE_THEME_COUNT; i++) {
+            numbers[PUZZLE_THEMES[i]] = i;
+        }
+        return numbers;
+    }();
+    auto found = theme_numbers.find(name);
+    return found == theme_numbers.end() ? -1 : found->second;
+}
+
+// turns a space separated Themes column ("crushing hangingPiece long middlegame") into a theme_set
+// unknown tags are skipped, so a newer dump with extra themes still loads. if unknown isn't null it is set to the
+// last tag we didn't know, so the caller can say something about it
+theme_set parse_themes(string_view themes, string_view* unknown = nullptr) {
+    theme_set set;
+    size_t start = 0;
+    while (start < themes.size()) {
+        size_t end = themes.find(' ', start);
+        if (end == string_view::npos) {
+            end = themes.size();
+        }
+        int theme = find_theme(themes.substr(start, end - start));
+        if (theme >= 0) {
+            set.add(theme);
+        }
+        else if (unknown != nullptr && end > start) {
+            *unknown = themes.substr(start, end - start);
+        }
+        start = end + 1;
+    }
+    return set;
+}
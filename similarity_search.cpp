@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "bitboard_utils.cpp"
+#include "board_state.cpp"
+#include "fen_batch.cpp"
+#include "work_stealing_pool.cpp"
+
+#if defined(__AVX2__) || (defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__))
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// "positions that look like this one": the distance between two positions is the number of bits that differ across
+// their 12 bitboards, so a piece that moved counts 2 (gone from one square, there on another), a piece swapped for a
+// different one counts 2, and a missing or extra piece counts 1. find_similar scans every position of a
+// bitboard_batch for the k closest to a query -- a few xors and popcounts per position, straight through the
+// struct-of-arrays bitboards, split into chunks over a work_stealing_pool
+
+struct similar_position {
+    uint32_t index;
+    uint32_t distance;
+};
+
+// closest first, ties to the lower index, so the answer doesn't depend on how the scan was split up
+inline bool closer(const similar_position& a, const similar_position& b) {
+    return a.distance != b.distance ? a.distance < b.distance : a.index < b.index;
+}
+
+// the k closest positions seen so far, kept as a heap with the furthest one on top
+// a scan goes through indexes in increasing order, so a candidate only has to beat bound() strictly to get in
+class nearest_positions {
+    private:
+
+    vector<similar_position> heap;
+    size_t k;
+
+    public:
+
+    explicit nearest_positions(size_t count) : k(count) {
+        heap.reserve(count);
+    }
+
+    // distances at or above this can't get in any more
+    uint32_t bound() const {
+        return heap.size() < k ? UINT32_MAX : heap.front().distance;
+    }
+
+    void offer(uint32_t index, uint32_t distance) {
+        if (distance >= bound()) return;
+        if (heap.size() == k) {
+            pop_heap(heap.begin(), heap.end(), closer);
+            heap.pop_back();
+        }
+        heap.push_back({index, distance});
+        push_heap(heap.begin(), heap.end(), closer);
+    }
+
+    const vector<similar_position>& positions() const {
+        return heap;
+    }
+};
+
+#if defined(__AVX2__) && !(defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__))
+// AVX2 has no popcount instruction, so this is the nibble lookup: a shuffle looks up the bit count of the low and the
+// high 4 bits of every byte. a byte of 12 xored bitboards adds up to at most 96, so the 12 are summed as bytes and only
+// then folded into one count per 64 bit lane (sad against zero)
+inline __m256i popcount_bytes(__m256i bits) {
+    const __m256i nibble_counts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(bits, low_nibbles));
+    __m256i high = _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(_mm256_srli_epi16(bits, 4), low_nibbles));
+    return _mm256_add_epi8(low, high);
+}
+#endif
+
+// distance of position index from query, one at a time
+inline uint32_t distance_at(const unsigned long long* const* boards, const unsigned long long* query, size_t index) {
+#if defined(__POPCNT__) || defined(_MSC_VER)
+    uint32_t distance = 0;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        distance += popcount64(boards[type][index] ^ query[type]);
+    }
+    return distance;
+#else
+    // without a popcount instruction __builtin_popcountll is a library call per bitboard. instead each xor is brought
+    // down to per-byte bit counts (at most 8), the 12 of them are summed bytewise (at most 96) and only the total is
+    // folded into one number
+    const uint64_t m1 = 0x5555555555555555ULL, m2 = 0x3333333333333333ULL, m4 = 0x0F0F0F0F0F0F0F0FULL;
+    uint64_t byte_counts = 0;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        uint64_t bits = boards[type][index] ^ query[type];
+        bits -= (bits >> 1) & m1;
+        bits = (bits & m2) + ((bits >> 2) & m2);
+        byte_counts += (bits + (bits >> 4)) & m4;
+    }
+    return (uint32_t)((byte_counts * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// offers every valid position in [begin, end) at least min_distance away from query to nearest
+// the vector loops only compute distances; a lane is looked at on its own only when it beats the current bound,
+// which after the first few thousand positions is almost never
+void scan_similar(const bitboard_batch& batch, const unsigned long long* query, size_t begin, size_t end,
+                  uint32_t min_distance, nearest_positions& nearest) {
+    const unsigned long long* boards[PIECE_TYPES];
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        boards[type] = batch.boards[type].data();
+    }
+    auto offer = [&](size_t index, uint32_t distance) {
+        if (distance >= min_distance && batch.valid[index]) {
+            nearest.offer((uint32_t)index, distance);
+        }
+    };
+
+    size_t i = begin;
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+    // 8 positions at a time with the native 64 bit popcount
+    __m512i query_lanes[PIECE_TYPES];
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        query_lanes[type] = _mm512_set1_epi64((long long)query[type]);
+    }
+    const __m512i minimum = _mm512_set1_epi64(min_distance);
+    for (; i + 8 <= end; i += 8) {
+        __m512i distances = _mm512_setzero_si512();
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            __m512i bits = _mm512_xor_si512(_mm512_loadu_si512(boards[type] + i), query_lanes[type]);
+            distances = _mm512_add_epi64(distances, _mm512_popcnt_epi64(bits));
+        }
+        __mmask8 wanted = _mm512_cmplt_epu64_mask(distances, _mm512_set1_epi64(nearest.bound())) &
+                          _mm512_cmpge_epu64_mask(distances, minimum);
+        if (wanted != 0) {
+            alignas(64) uint64_t lanes[8];
+            _mm512_store_si512(lanes, distances);
+            for (unsigned mask = wanted; mask != 0; mask &= mask - 1) {
+                int lane = lowest_bit_index(mask);
+                offer(i + lane, (uint32_t)lanes[lane]);
+            }
+        }
+    }
+#elif defined(__AVX2__)
+    // 4 positions at a time
+    __m256i query_lanes[PIECE_TYPES];
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        query_lanes[type] = _mm256_set1_epi64x((long long)query[type]);
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i below_minimum = _mm256_set1_epi64x((long long)min_distance - 1);
+    for (; i + 4 <= end; i += 4) {
+        __m256i counts = zero;
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            __m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(boards[type] + i));
+            counts = _mm256_add_epi8(counts, popcount_bytes(_mm256_xor_si256(bits, query_lanes[type])));
+        }
+        __m256i distances = _mm256_sad_epu8(counts, zero);
+        __m256i bound = _mm256_set1_epi64x((long long)nearest.bound());
+        __m256i wanted = _mm256_and_si256(_mm256_cmpgt_epi64(bound, distances),
+                                          _mm256_cmpgt_epi64(distances, below_minimum));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(wanted));
+        if (mask != 0) {
+            alignas(32) uint64_t lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), distances);
+            for (; mask != 0; mask &= mask - 1) {
+                int lane = lowest_bit_index((uint64_t)mask);
+                offer(i + lane, (uint32_t)lanes[lane]);
+            }
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        uint32_t distance = distance_at(boards, query, i);
+        if (distance < nearest.bound()) {
+            offer(i, distance);
+        }
+    }
+}
+
+// the k valid positions of batch closest to query, closest first. positions nearer than min_distance are left out,
+// which by default is only the query itself (or an exact copy of it)
+// with a pool the batch is scanned in chunks on its workers, each keeping its own k closest, and those are merged at
+// the end. this waits for the pool to go idle, so give it a pool that isn't busy with anything else
+vector<similar_position> find_similar(const bitboard_batch& batch, const board_state& query, size_t k,
+                                      work_stealing_pool* pool = nullptr, uint32_t min_distance = 1) {
+    if (k == 0 || batch.size() == 0) {
+        return {};
+    }
+    unsigned long long query_boards[PIECE_TYPES];
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        query_boards[type] = query.get_bitboard((piece_type)type);
+    }
+
+    // big enough that a chunk is mostly scanning, small enough that stealing can even out the workers
+    const size_t CHUNK = 1 << 16;
+    size_t chunks = (batch.size() + CHUNK - 1) / CHUNK;
+    vector<nearest_positions> partial(chunks, nearest_positions(k));
+    auto scan_chunk = [&](size_t chunk) {
+        scan_similar(batch, query_boards, chunk * CHUNK, min(batch.size(), (chunk + 1) * CHUNK), min_distance,
+                     partial[chunk]);
+    };
+    if (pool != nullptr && pool->size() > 1 && chunks > 1) {
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            pool->submit(chunk, [&scan_chunk, chunk]() { scan_chunk(chunk); });
+        }
+        pool->wait_idle();
+    }
+    else {
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            scan_chunk(chunk);
+        }
+    }
+
+    vector<similar_position> merged;
+    for (const auto& nearest : partial) {
+        merged.insert(merged.end(), nearest.positions().begin(), nearest.positions().end());
+    }
+    size_t count = min(k, merged.size());
+    partial_sort(merged.begin(), merged.begin() + count, merged.end(), closer);
+    merged.resize(count);
+    return merged;
+}
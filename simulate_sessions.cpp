@@ -0,0 +1,83 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include "board_state.cpp"
+#include "memory_chess_core.cpp"
+#include "position_loader.cpp"
+
+using namespace std;
+
+// load test for the game core: plays whole games with no window, as fast as the machine allows
+// every game starts a puzzle, skips the memorizing time on a fake clock, drags the pieces back on (with a few
+// mistakes, like a real player), and checks the result
+//
+//   simulate_sessions lichess_db_puzzle.pack 100000
+//   simulate_sessions lichess_db_puzzle.csv
+
+// one simulated player. accuracy is the chance of putting each piece back on the right square
+void play_session(game_session& session, double& now, double accuracy, mt19937_64& random_engine) {
+    uniform_real_distribution<double> chance(0.0, 1.0);
+    uniform_int_distribution<int> any_square(0, 63);
+
+    session.handle({INPUT_START});
+    // look at the position for the full five seconds
+    now += 5.0;
+    session.update();
+
+    unsigned long long occupied = session.get_solution().occupancy();
+    for (; occupied != 0; occupied &= occupied - 1) {
+        int square = lowest_bit_index(occupied);
+        char piece = session.get_solution().get_piece_at(square);
+        session.handle({INPUT_PICK_PIECE, piece});
+        session.handle({INPUT_DROP_PIECE, ' ', chance(random_engine) < accuracy ? square : any_square(random_engine)});
+        now += 0.5;
+    }
+
+    session.handle({INPUT_CHECK});
+    now += 3.0;
+    session.update();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "usage: simulate_sessions <csv or pack> [sessions]" << endl;
+        return 1;
+    }
+    string filename = argv[1];
+    long sessions = argc >= 3 ? atol(argv[2]) : 100000;
+
+    position_loader loader;
+    bool is_pack = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".pack") == 0;
+    if (!(is_pack ? loader.open_position_pack(filename) : loader.load_position_mapped(filename))) {
+        return 1;
+    }
+
+    // the clock only moves when play_session says so
+    double now = 0;
+    auto puzzles = [&loader](board_state& puzzle) {
+        if (loader.get_available_count() == 0) return false;
+        puzzle = loader.get_random_board();
+        return true;
+    };
+
+    mt19937_64 random_engine(12345);
+    uint64_t solved = 0;
+    uint64_t correct_squares = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < sessions; i++) {
+        game_session session(puzzles, [&now]() { return now; });
+        play_session(session, now, 0.95, random_engine);
+        solved += session.was_last_check_solved();
+        correct_squares += session.get_last_correct_count();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Played " << sessions << " sessions in " << seconds << "s (" << (long)(sessions / seconds) << " per second)"
+         << endl;
+    cout << "Solved " << solved << ", average " << (double)correct_squares / max(sessions, 1L) << "/64 squares correct"
+         << endl;
+    return 0;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// fixed set of worker threads, each with its own task queue
+// submit() puts a task on the queue picked by its shard, so work for the same shard (e.g. one client connection)
+// lands on the same worker and stays cache-warm. a worker with nothing left takes from the front of another
+// worker's queue instead of sleeping, so one busy shard can't leave the other threads idle
+class work_stealing_pool {
+    private:
+
+    struct worker_queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<worker_queue>> queues;
+    vector<thread> workers;
+
+    // tasks submitted but not yet picked up; sleeping workers wait for this to go above zero
+    atomic<size_t> pending{0};
+    // tasks submitted but not yet finished, for wait_idle
+    atomic<size_t> unfinished{0};
+    mutex sleep_lock;
+    condition_variable wake;
+    condition_variable idle;
+    bool stopping = false;
+
+    bool take(size_t worker, function<void()>& task) {
+        // own queue from the back (the newest task, most likely still in cache), others from the front
+        {
+            worker_queue& own = *queues[worker];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            worker_queue& victim = *queues[(worker + i) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t worker) {
+        function<void()> task;
+        while (true) {
+            if (take(worker, task)) {
+                pending.fetch_sub(1, memory_order_relaxed);
+                task();
+                task = nullptr;
+                if (unfinished.fetch_sub(1, memory_order_acq_rel) == 1) {
+                    lock_guard<mutex> guard(sleep_lock);
+                    idle.notify_all();
+                }
+                continue;
+            }
+            unique_lock<mutex> guard(sleep_lock);
+            wake.wait(guard, [this]() { return stopping || pending.load(memory_order_relaxed) > 0; });
+            if (stopping && pending.load(memory_order_relaxed) == 0) {
+                return;
+            }
+        }
+    }
+
+    public:
+
+    explicit work_stealing_pool(unsigned threads = thread::hardware_concurrency()) {
+        threads = max(threads, 1u);
+        for (unsigned i = 0; i < threads; i++) {
+            queues.push_back(make_unique<worker_queue>());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this, i]() { run(i); });
+        }
+    }
+
+    // finishes every task already submitted, then stops the workers
+    ~work_stealing_pool() {
+        {
+            lock_guard<mutex> guard(sleep_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    void submit(size_t shard, function<void()> task) {
+        unfinished.fetch_add(1, memory_order_relaxed);
+        {
+            // under the sleep lock so a worker can't check pending, miss this task and then go to sleep. and before
+            // the task is queued, so a worker that takes it straight away never brings pending below zero
+            lock_guard<mutex> guard(sleep_lock);
+            pending.fetch_add(1, memory_order_relaxed);
+        }
+        {
+            worker_queue& queue = *queues[shard % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(move(task));
+        }
+        wake.notify_one();
+    }
+
+    // blocks until every submitted task has finished
+    void wait_idle() {
+        unique_lock<mutex> guard(sleep_lock);
+        idle.wait(guard, [this]() { return unfinished.load(memory_order_acquire) == 0; });
+    }
+};